@@ -27,11 +27,10 @@ See libzpaq.h for additional documentation.
 #include <string>
 #include <vector>
 #include <stdio.h>
+#include <math.h>
 
 #ifdef unix
-#ifndef NOJIT
 #include <sys/mman.h>
-#endif
 #else
 #include <windows.h>
 #include <wincrypt.h>
@@ -98,6 +97,30 @@ void allocx(U8* &p, int &n, int newsize) {
 #endif
 }
 
+// Blocks of at least this many bytes are allocated with mmap() or
+// VirtualAlloc(). Fresh pages from the OS are already zero, so a large
+// hash table or buffer that is mostly unused costs no time to clear.
+static const size_t ALLOCZ_MAP=1<<18;
+
+void* allocz(size_t n) {
+  if (n<ALLOCZ_MAP) return ::calloc(n, 1);
+#ifdef unix
+  void* p=mmap(0, n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  return p==MAP_FAILED ? 0 : p;
+#else
+  return VirtualAlloc(0, n, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+#endif
+}
+
+void freez(void* p, size_t n) {
+  if (n<ALLOCZ_MAP) ::free(p);
+#ifdef unix
+  else munmap(p, n);
+#else
+  else VirtualFree(p, 0, MEM_RELEASE);
+#endif
+}
+
 //////////////////////////// SHA1 ////////////////////////////
 
 // SHA1 code, see http://en.wikipedia.org/wiki/SHA-1
@@ -932,6 +955,7 @@ int ZPAQL::read(Reader* in2) {
 void ZPAQL::clear() {
   cend=hbegin=hend=0;  // COMP and HCOMP locations
   a=b=c=d=f=pc=0;      // machine state
+  aot=0;
   header.resize(0);
   h.resize(0);
   m.resize(0);
@@ -945,6 +969,7 @@ ZPAQL::ZPAQL() {
   sha1=0;
   rcode=0;
   rcode_size=0;
+  aot=0;
   clear();
   outbuf.resize(1<<14);
   bufptr=0;
@@ -960,12 +985,14 @@ void ZPAQL::inith() {
   assert(output==0);
   assert(sha1==0);
   init(header[2], header[3]); // hh, hm
+  aot=AOT::find(*this, false);
 }
 
 // Initialize machine state as PCOMP
 void ZPAQL::initp() {
   assert(header.isize()>6);
   init(header[4], header[5]); // ph, pm
+  aot=AOT::find(*this, true);
 }
 
 // Flush pending output
@@ -1702,6 +1729,44 @@ static const U8 stdt[712]={
      0,     0,     0,     0,     0,     0,     1,     0
 };
 
+// Model independent tables are computed once when the program starts.
+// Each Predictor gets a copy because JIT code addresses them relative
+// to the Predictor.
+static struct PredictorTables {
+  U16 squasht[4096];    // squash() lookup table
+  short stretcht[32768];// stretch() lookup table
+  PredictorTables();
+} ptables;
+
+PredictorTables::PredictorTables() {
+
+  // ssquasht[i]=int(32768.0/(1+exp((i-2048)*(-1.0/64))));
+  // Copy middle 1344 of 4096 entries.
+  memset(squasht, 0, 1376*2);
+  memcpy(squasht+1376, ssquasht, 1344*2);
+  for (int i=2720; i<4096; ++i) squasht[i]=32767;
+
+  // sstretcht[i]=int(log((i+0.5)/(32767.5-i))*64+0.5+100000)-100000;
+  int k=16384;
+  for (int i=0; i<712; ++i)
+    for (int j=stdt[i]; j>0; --j)
+      stretcht[k++]=i;
+  assert(k==32768);
+  for (int i=0; i<16384; ++i)
+    stretcht[i]=-stretcht[32767-i];
+
+#ifndef NDEBUG
+  // Verify floating point math for squash() and stretch()
+  U32 sqsum=0, stsum=0;
+  for (int i=32767; i>=0; --i)
+    stsum=stsum*3+stretcht[i];
+  for (int i=4095; i>=0; --i)
+    sqsum=sqsum*3+squasht[i];
+  assert(stsum==3887533746u);
+  assert(sqsum==2278286169u);
+#endif
+}
+
 Predictor::Predictor(ZPAQL& zr):
     c8(1), hmap4(1), z(zr) {
   assert(sizeof(U8)==1);
@@ -1712,6 +1777,7 @@ Predictor::Predictor(ZPAQL& zr):
   assert(sizeof(int)==4);
   pcode=0;
   pcode_size=0;
+  aot=0;
   initTables=false;
 }
 
@@ -1725,40 +1791,18 @@ void Predictor::init() {
   // Clear old JIT code if any
   allocx(pcode, pcode_size, 0);
 
-  // Initialize context hash function
+  // Initialize context hash function. Use compiled code if any.
   z.inith();
+  aot=AOT::find(z, false);
+  if (aot && !aot->predict) aot=0;
 
   // Initialize model independent tables
   if (!initTables && isModeled()) {
     initTables=true;
     memcpy(dt2k, sdt2k, sizeof(dt2k));
     memcpy(dt, sdt, sizeof(dt));
-
-    // ssquasht[i]=int(32768.0/(1+exp((i-2048)*(-1.0/64))));
-    // Copy middle 1344 of 4096 entries.
-    memset(squasht, 0, 1376*2);
-    memcpy(squasht+1376, ssquasht, 1344*2);
-    for (int i=2720; i<4096; ++i) squasht[i]=32767;
-
-    // sstretcht[i]=int(log((i+0.5)/(32767.5-i))*64+0.5+100000)-100000;
-    int k=16384;
-    for (int i=0; i<712; ++i)
-      for (int j=stdt[i]; j>0; --j)
-        stretcht[k++]=i;
-    assert(k==32768);
-    for (int i=0; i<16384; ++i)
-      stretcht[i]=-stretcht[32767-i];
-
-#ifndef NDEBUG
-    // Verify floating point math for squash() and stretch()
-    U32 sqsum=0, stsum=0;
-    for (int i=32767; i>=0; --i)
-      stsum=stsum*3+stretch(i);
-    for (int i=4095; i>=0; --i)
-      sqsum=sqsum*3+squash(i-2048);
-    assert(stsum==3887533746u);
-    assert(sqsum==2278286169u);
-#endif
+    memcpy(squasht, ptables.squasht, sizeof(squasht));
+    memcpy(stretcht, ptables.stretcht, sizeof(stretcht));
   }
 
   // Initialize predictions
@@ -2100,29 +2144,52 @@ void Decoder::init() {
   else low=high=curr=0;
 }
 
-// Return next bit of decoded input, which has 16 bit probability p of being 1
-int Decoder::decode(int p) {
+// Return next bit of decoded input, which has 16 bit probability p of being 1.
+// The range is narrowed with a mask rather than a branch on the bit,
+// which is unpredictable when the model is good.
+inline int Decoder::decode(int p) {
   assert(pr.isModeled());
   assert(p>=0 && p<65536);
   assert(high>low && low>0);
-  if (curr<low || curr>high) error("archive corrupted");
+  if (curr-low>high-low) error("archive corrupted");  // curr<low || curr>high
   assert(curr>=low && curr<=high);
   U32 mid=low+U32(((high-low)*U64(U32(p)))>>16);  // split range
   assert(high>mid && mid>=low);
-  int y;
-  if (curr<=mid) y=1, high=mid;  // pick half
-  else y=0, low=mid+1;
-  while ((high^low)<0x1000000) { // shift out identical leading bytes
-    high=high<<8|255;
-    low=low<<8;
-    low+=(low==0);
-    int c=get();
-    if (c<0) error("unexpected end of file");
-    curr=curr<<8|c;
-  }
+  const int y=curr<=mid;
+  const U32 m=0-U32(y);    // all 1s if y else 0
+  high+=(mid-high)&m;      // pick half
+  low+=(mid+1-low)&~m;
+  if ((high^low)<0x1000000) shift();
   return y;
 }
 
+// Shift out identical leading bytes of low and high and shift in input.
+// This takes at most 4 bytes (at EOS, when high==low), so if that many
+// are buffered they are read directly from buf without checking each one.
+void Decoder::shift() {
+  if (wpos-rpos>=4) {
+    const U8* p=(const U8*)&buf[rpos];
+    do {
+      high=high<<8|255;
+      low=low<<8;
+      low+=(low==0);
+      curr=curr<<8|*p++;
+    } while ((high^low)<0x1000000);
+    rpos=p-(const U8*)&buf[0];
+    assert(rpos<=wpos);
+  }
+  else {
+    do {
+      high=high<<8|255;
+      low=low<<8;
+      low+=(low==0);
+      int c=get();
+      if (c<0) error("unexpected end of file");
+      curr=curr<<8|c;
+    } while ((high^low)<0x1000000);
+  }
+}
+
 // Decompress 1 byte or -1 at end of input
 int Decoder::decompress() {
   if (pr.isModeled()) {  // n>0 components?
@@ -2154,14 +2221,32 @@ int Decoder::decompress() {
   }
 }
 
-// Find end of compressed data and return next byte
+// Find end of compressed data and return next byte. Whole buffers are
+// skipped at a time: modeled data is searched with memchr() for the next
+// zero byte, since only a run of 4 zeros can end it, and stored data is
+// skipped by its length prefix.
 int Decoder::skip() {
   int c=-1;
   if (pr.isModeled()) {
     while (curr==0)  // at start?
       curr=get();
-    while (curr && (c=get())>=0)  // find 4 zeros
+    while (curr) {  // find 4 zeros
+      if (curr&255) {  // skip to the next zero byte
+        if (rpos==wpos) {
+          rpos=0;
+          wpos=in ? in->read(&buf[0], BUFSIZE) : 0;
+          if (wpos==0) return -1;
+        }
+        const char* p=(const char*)memchr(&buf[rpos], 0, wpos-rpos);
+        if (!p) {
+          rpos=wpos;
+          continue;
+        }
+        rpos=p-&buf[0];
+      }
+      if ((c=get())<0) return -1;
       curr=curr<<8|c;
+    }
     while ((c=get())==0) ;  // might be more than 4
     return c;
   }
@@ -2170,8 +2255,15 @@ int Decoder::skip() {
       for (int i=0; i<4 && (c=get())>=0; ++i) curr=curr<<8|c;
     while (curr>0) {
       while (curr>0) {
-        --curr;
-        if (get()<0) return error("skipped to EOF"), -1;
+        if (rpos==wpos) {
+          rpos=0;
+          wpos=in ? in->read(&buf[0], BUFSIZE) : 0;
+          if (wpos==0) return error("skipped to EOF"), -1;
+        }
+        U32 n=wpos-rpos;
+        if (n>curr) n=curr;
+        rpos+=n;
+        curr-=n;
       }
       for (int i=0; i<4 && (c=get())>=0; ++i) curr=curr<<8|c;
     }
@@ -2394,33 +2486,49 @@ void decompress(Reader* in, Writer* out) {
 void Encoder::init() {
   low=1;
   high=0xFFFFFFFF;
+  opos=0;
   pr.init();
   if (!pr.isModeled()) low=0, buf.resize(1<<16);
+  else if (obuf.size()==0) obuf.resize(BUFSIZE);
 }
 
 // compress bit y having probability p/64K
-void Encoder::encode(int y, int p) {
+inline void Encoder::encode(int y, int p) {
   assert(out);
   assert(p>=0 && p<65536);
   assert(y==0 || y==1);
   assert(high>low && low>0);
   U32 mid=low+U32(((high-low)*U64(U32(p)))>>16);  // split range
   assert(high>mid && mid>=low);
-  if (y) high=mid; else low=mid+1; // pick half
-  while ((high^low)<0x1000000) { // write identical leading bytes
-    out->put(high>>24);  // same as low>>24
+  const U32 m=0-U32(y);    // all 1s if y else 0
+  high+=(mid-high)&m;      // pick half
+  low+=(mid+1-low)&~m;
+  if ((high^low)<0x1000000) shift();
+}
+
+// Write identical leading bytes of low and high to obuf, at most 4.
+// obuf is written to out when full and at the end of the segment.
+void Encoder::shift() {
+  if (opos+4>BUFSIZE) out->write(&obuf[0], opos), opos=0;
+  char* p=&obuf[opos];
+  do {
+    *p++=high>>24;  // same as low>>24
     high=high<<8|255;
     low=low<<8;
     low+=(low==0); // so we don't code 4 0 bytes in a row
-  }
+  } while ((high^low)<0x1000000);
+  opos=p-&obuf[0];
+  assert(opos<=BUFSIZE);
 }
 
 // compress byte c (0..255 or -1=EOS)
 void Encoder::compress(int c) {
   assert(out);
   if (pr.isModeled()) {
-    if (c==-1)
+    if (c==-1) {
       encode(1, 0);
+      if (opos) out->write(&obuf[0], opos), opos=0;
+    }
     else {
       assert(c>=0 && c<=255);
       encode(0, 0);
@@ -4584,9 +4692,11 @@ int Predictor::assemble_p() {
 
 #endif // ifndef NOJIT
 
-// Return a prediction of the next bit in range 0..32767
-// Use JIT code starting at pcode[0] if available, or else create it.
+// Return a prediction of the next bit in range 0..32767. Use compiled
+// code if any, else JIT code starting at pcode[0] if available, or else
+// create it.
 int Predictor::predict() {
+  if (aot) return (this->*aot->predict)();
 #ifdef NOJIT
   return predict0();
 #else
@@ -4606,8 +4716,12 @@ int Predictor::predict() {
 }
 
 // Update the model with bit y = 0..1
-// Use the JIT code starting at pcode[5].
+// Use compiled code if any, else the JIT code starting at pcode[5].
 void Predictor::update(int y) {
+  if (aot) {
+    (this->*aot->update)(y);
+    return;
+  }
 #ifdef NOJIT
   update0(y);
 #else
@@ -4629,9 +4743,13 @@ void Predictor::update(int y) {
 #endif
 }
 
-// Execute the ZPAQL code with input byte or -1 for EOF.
-// Use JIT code at rcode if available, or else create it.
+// Execute the ZPAQL code with input byte or -1 for EOF. Use compiled
+// code if any, else JIT code at rcode if available, or else create it.
 void ZPAQL::run(U32 input) {
+  if (aot) {
+    (this->*aot->run)(input);
+    return;
+  }
 #ifdef NOJIT
   run0(input);
 #else
@@ -6458,6 +6576,183 @@ void e8e9(unsigned char* buf, int n) {
   }
 }
 
+// Transpose buf[0..n-1] as rows of w bytes to w columns, so that byte
+// c of row r moves to c*rows+r. If delta then first subtract the same
+// byte of the row before it. Bytes after the last whole row stay.
+// The postprocessor for method N2=8 is the inverse.
+void transpose(unsigned char* buf, unsigned n, int w, bool delta) {
+  assert(w>0);
+  const unsigned rows=n/w;
+  if (rows<1) return;
+  Array<U8> t(rows*w);
+  for (unsigned r=0; r<rows; ++r)
+    for (int c=0; c<w; ++c)
+      t[c*rows+r]=buf[r*w+c]-(delta && r>0 ? buf[(r-1)*w+c] : 0);
+  memcpy(buf, &t[0], rows*w);
+}
+
+// Word transform. Replace up to 202 of the words of 2..32 lower case
+// letters that save the most space in in with the rarest non-letter
+// byte values. Replace a capital letter followed by lower case letters
+// with a capital code followed by the word in lower case. Bytes that
+// are used as codes are written after an escape code. The output
+// starts with the escape code, the capital code, the number of words,
+// and for each word, its code, length, and letters. Return false and
+// leave in unchanged if the output would be larger than limit times
+// the input size. The postprocessor for method N2=9 is the inverse.
+
+// A distinct word in wordpre()
+struct Word {
+  unsigned pos;    // first occurrence in input, maybe capitalized
+  int len;         // number of letters, 0 if slot is empty
+  int count;       // occurrences
+  int code;        // byte value that replaces it, or -1
+  int gain() const {return count*(len-1)-len-2;}
+  bool operator<(const Word& w) const {return gain()>w.gain();}
+};
+
+// Return 1 if the run of len letters at p is lower case, 2 if it is
+// capitalized, else 0
+static int wordForm(const unsigned char* p, int len) {
+  if (len<1) return 0;
+  const int r=(p[0]>='A' && p[0]<='Z') ? 2 : 1;
+  for (int j=r-1; j<len; ++j)
+    if (p[j]<'a' || p[j]>'z') return 0;
+  return r;
+}
+
+// Return the slot for p[i..i+len-1] in hash table t[0..mask], ignoring
+// the case of the first letter. It is empty if the word is not found.
+static unsigned wordSlot(std::vector<Word>& t, unsigned mask,
+                         const unsigned char* p, unsigned i, int len) {
+  unsigned h=len;
+  for (int j=0; j<len; ++j) h=(h*773+(p[i+j]|32))*3;
+  for (h&=mask; t[h].len; h=(h+1)&mask) {
+    const unsigned char* q=p+t[h].pos;
+    if (t[h].len==len && (q[0]|32)==(p[i]|32)
+        && memcmp(q+1, p+i+1, len-1)==0)
+      break;
+  }
+  return h;
+}
+
+// Return true if c is an ASCII letter
+static bool isLetter(int c) {
+  return (c|32)>='a' && (c|32)<='z';
+}
+
+// Compare byte values by count in wordpre(), then by value
+struct ByteOrder {
+  const unsigned* count;
+  bool operator()(int a, int b) const {
+    return count[a]<count[b] || (count[a]==count[b] && a<b);
+  }
+};
+
+bool wordpre(StringBuffer& in, double limit) {
+  const unsigned char* p=in.data();
+  const unsigned n=in.size();
+
+  // Count words in a hash table t[0..mask] and bytes in count
+  unsigned count[256]={0};
+  for (unsigned i=0; i<n; ++i) ++count[p[i]];
+  unsigned mask=255;
+  while (mask<n/8 && mask<(1u<<20)-1) mask=mask*2+1;
+  std::vector<Word> t(mask+1);
+  const Word empty={0, 0, 0, -1};
+  std::fill(t.begin(), t.end(), empty);
+  unsigned words=0;  // distinct words in t
+  unsigned caps=0;   // capitalized words
+  for (unsigned i=0; i<n;) {
+    unsigned j=i;
+    while (j<n && isLetter(p[j])) ++j;
+    const int len=j-i;
+    const int form=wordForm(p+i, len);
+    caps+=form==2;
+    if (len>=2 && len<=32 && form) {
+      const unsigned h=wordSlot(t, mask, p, i, len);
+      if (t[h].len) ++t[h].count;
+      else if (words<mask/2) {
+        t[h].pos=i, t[h].len=len, t[h].count=1;
+        ++words;
+      }
+    }
+    i=j>i ? j : i+1;
+  }
+
+  // Sort non-letters from rarest. The first two are the escape and
+  // capital codes.
+  std::vector<int> codes;
+  for (int i=0; i<256; ++i)
+    if (!isLetter(i)) codes.push_back(i);
+  ByteOrder order={count};
+  std::sort(codes.begin(), codes.end(), order);
+  const int esc=codes[0], capcode=codes[1];
+  codes.erase(codes.begin(), codes.begin()+2);
+
+  // Pick the words that save the most and assign codes while they save
+  // more than escaping the code costs
+  std::vector<Word> dict;
+  for (unsigned i=0; i<=mask; ++i)
+    if (t[i].len && t[i].gain()>0) dict.push_back(t[i]);
+  std::sort(dict.begin(), dict.end());
+  unsigned k=0;  // number of words
+  double size=n+3+caps+count[esc]+count[capcode];  // output size
+  bool escaped[256]={false};
+  escaped[esc]=escaped[capcode]=true;
+  for (; k<dict.size() && k<codes.size()
+         && dict[k].gain()>int(count[codes[k]]); ++k) {
+    const unsigned h=wordSlot(t, mask, p, dict[k].pos, dict[k].len);
+    t[h].code=dict[k].code=codes[k];
+    escaped[codes[k]]=true;
+    size-=dict[k].gain()-count[codes[k]];
+  }
+  if (size>limit*n) return false;
+
+  // Write the header and the transformed words
+  StringBuffer out(n);
+  out.put(esc);
+  out.put(capcode);
+  out.put(k);
+  for (unsigned i=0; i<k; ++i) {
+    out.put(dict[i].code);
+    out.put(dict[i].len);
+    out.put(p[dict[i].pos]|32);
+    out.write((const char*)p+dict[i].pos+1, dict[i].len-1);
+  }
+  for (unsigned i=0; i<n;) {
+    unsigned j=i;
+    while (j<n && isLetter(p[j])) ++j;
+    const int len=j-i;
+    const int form=wordForm(p+i, len);
+    if (form==2) out.put(capcode);
+    if (form && len>=2 && len<=32) {
+      const unsigned h=wordSlot(t, mask, p, i, len);
+      if (t[h].len && t[h].code>=0) {
+        out.put(t[h].code);
+        i=j;
+        continue;
+      }
+    }
+    if (form) {
+      out.put(p[i]|32);
+      out.write((const char*)p+i+1, len-1);
+    }
+    else if (len>0)
+      out.write((const char*)p+i, len);
+    else {
+      if (escaped[p[j]]) out.put(esc);
+      out.put(p[j++]);
+    }
+    i=j;
+  }
+  in.swap(out);
+  return true;
+}
+
+// Runs LZ77 suffix array searches in parallel if set by the application
+int (*parallelFor)(void (*f)(void*, int), void* arg, int n)=0;
+
 // Encode inbuf to buf using LZ77. args are as follows:
 // args[0] is log2 buffer size in MB.
 // args[1] is level (1=var. length, 2=byte aligned lz77, 3=bwt) + 4 if E8E9.
@@ -6469,6 +6764,17 @@ void e8e9(unsigned char* buf, int n) {
 // sap is pointer to external suffix array of inbuf or 0. If supplied and
 //   args[0]=5..7 then it is assumed that E8E9 was already applied to
 //   both the input and sap and the input buffer is not modified.
+//
+// With a suffix array and parallelFor, matches are found ahead of the
+// parse in chunks of up to CHUNK positions. Each SEGMENT of a chunk is
+// parsed separately in parallel as fill() would, saving the best match
+// found at each position it visits in mt. fill() then parses the chunk
+// in order, using mt where it visits the same position with the same
+// pending literals state and searching again where it does not. Since
+// the search depends only on the position and whether literals are
+// pending, the output is the same either way. Segments after the first
+// start by guessing that no literals are pending, but soon land on the
+// same positions as the real parse.
 
 class LZBuffer: public libzpaq::Reader {
   libzpaq::Array<unsigned> ht;// hash table, confirm in low bits, or SA+ISA
@@ -6494,12 +6800,35 @@ class LZBuffer: public libzpaq::Reader {
   unsigned idx;               // BWT index
   const unsigned* sa;         // suffix array for BWT or LZ77-SA
   unsigned* isa;              // inverse suffix array for LZ77-SA
+  unsigned isawin;            // 1 + first position in isa, 0 if none
   enum {BUFSIZE=1<<14};       // output buffer size
   unsigned char buf[BUFSIZE]; // output buffer
+  enum {CHUNK=1<<18, SEGMENT=1<<14};  // positions to find matches ahead
+  enum {ISAPART=1<<20};       // SA elements per task to load ISA
+  struct Match {              // best match at a position in mt
+    unsigned bp;              // start of match, or position if none
+    unsigned short len;       // match length including literals
+    unsigned char lit;        // leading literals
+    unsigned char state;      // 0=not found, 1=lit==0, 2=lit>0
+  };
+  libzpaq::Array<Match> mt;   // matches found ahead, or empty if not used
+  unsigned mtstart, mtend;    // positions in mt
+  unsigned mtlit;             // pending literals at mtstart
 
   void write_literal(unsigned i, unsigned& lit);
   void write_match(unsigned len, unsigned off);
   void fill();  // encode to buf
+  void loadISA(unsigned i);   // load ISA for the window containing i
+  static void loadPart(void* arg, int k);  // part k of SA to ISA
+  void find(unsigned i, bool litzero, unsigned& blen, unsigned& bp,
+            unsigned& blit) const;  // search SA for a match at i
+  void findAhead(unsigned lit);     // fill mt from i in parallel
+  static void findSegment(void* arg, int k);  // segment k of mt
+
+  // shortest match worth coding at offset off
+  unsigned minLen(unsigned off) const {
+    return minMatch+(level==2)*((off>=(1<<16))+(off>=(1<<24)));
+  }
 
   // write k bits of x
   void putb(unsigned x, int k) {
@@ -6615,7 +6944,7 @@ LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
     minMatchBoth(MAX(minMatch, minMatch2+lookahead)+4),
     rb(args[0]>4 ? args[0]-4 : 0),
     bits(0), nbits(0), rpos(0), wpos(0),
-    idx(0), sa(0), isa(0) {
+    idx(0), sa(0), isa(0), isawin(0), mtstart(0), mtend(0), mtlit(0) {
   assert(args[0]>=0);
   assert(n<=(1u<<20<<args[0]));
   assert(args[1]>=1 && args[1]<=7 && args[1]!=4);
@@ -6639,7 +6968,94 @@ LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
     if (level<3) {
       assert(ht.size()>=(n*(sap==0))+(1u<<17<<args[0]));
       isa=&ht[n*(sap==0)];
+      if (parallelFor && n>=SEGMENT*2) mt.resize(MIN(n, unsigned(CHUNK)));
+    }
+  }
+}
+
+// Rebuild the inverse suffix array for the window of positions with the
+// same high bits as i, unless already loaded. Each part of SA sets
+// different elements of isa, so with parallelFor they are scanned at
+// the same time.
+void LZBuffer::loadISA(unsigned i) {
+  const unsigned mask=(1<<checkbits)-1;
+  if (isawin==(i&~mask)+1) return;
+  isawin=(i&~mask)+1;
+  const int parts=(n+ISAPART-1)/ISAPART;
+  if (parallelFor && parts>1) parallelFor(loadPart, this, parts);
+  else for (int k=0; k<parts; ++k) loadPart(this, k);
+}
+
+// Set isa for the loaded window from sa[k*ISAPART...]
+void LZBuffer::loadPart(void* arg, int k) {
+  LZBuffer& lz=*(LZBuffer*)arg;
+  const unsigned mask=(1<<lz.checkbits)-1, win=lz.isawin-1;
+  const unsigned end=MIN(lz.n, (k+1)*unsigned(ISAPART));
+  for (unsigned j=k*ISAPART; j<end; ++j)
+    if ((lz.sa[j]&~mask)==win)
+      lz.isa[lz.sa[j]&mask]=j;
+}
+
+// Search the suffix array near in[i..i+lookahead] for the best match
+// to code at i, given whether any literals are pending. The ISA window
+// containing i must be loaded. Return the match in in[bp..bp+blen-1],
+// of which the first blit bytes are coded as literals, or bp=i if none.
+void LZBuffer::find(unsigned i, bool litzero, unsigned& blen, unsigned& bp,
+                    unsigned& blit) const {
+  const unsigned mask=(1<<checkbits)-1;
+  blen=minMatch-1, bp=i, blit=0;
+  int bscore=0;  // best cost
+  for (unsigned h=0; h<=lookahead; ++h) {
+    unsigned q=isa[(h+i)&mask];  // location of h+i in SA
+    assert(q<n);
+    if (sa[q]!=h+i) continue;
+    for (int j=-1; j<=1; j+=2) {  // search backward and forward
+      for (unsigned k=1; k<=bucket; ++k) {
+        unsigned p;  // match to be tested
+        if (q+j*k<n && (p=sa[q+j*k]-h)<i) {
+          assert(p<n);
+          unsigned l, l1;  // length of match, leading literals
+          for (l=h; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+          for (l1=h; l1>0 && in[p+l1-1]==in[i+l1-1]; --l1);
+          int score=int(l-l1)*8-lg(i-p)-4*(litzero && l1>0)-11;
+          for (unsigned a=0; a<h; ++a) score=score*5/8;
+          if (score>bscore) blen=l, bp=p, blit=l1, bscore=score;
+          if (l<blen || l<minMatch || l>255) break;
+        }
+      }
     }
+    if (bscore<=0 || blen<minMatch) break;
+  }
+}
+
+// Find matches for up to CHUNK positions starting at i in the same ISA
+// window, with lit literals pending at i. Segments run in parallel.
+void LZBuffer::findAhead(unsigned lit) {
+  const unsigned mask=(1<<checkbits)-1;
+  loadISA(i);
+  mtstart=i;
+  mtend=MIN(MIN(n, (i|mask)+1), i+unsigned(mt.size()));
+  mtlit=lit;
+  memset(&mt[0], 0, (mtend-mtstart)*sizeof(Match));
+  parallelFor(findSegment, this, (mtend-mtstart+SEGMENT-1)/SEGMENT);
+}
+
+// Parse segment k of mt as fill() would, saving the matches found.
+void LZBuffer::findSegment(void* arg, int k) {
+  LZBuffer& lz=*(LZBuffer*)arg;
+  unsigned i=lz.mtstart+k*SEGMENT;
+  const unsigned end=MIN(i+SEGMENT, lz.mtend);
+  unsigned lit=k ? 0 : lz.mtlit;  // guess after the first segment
+  while (i<end) {
+    unsigned blen, bp, blit;
+    lz.find(i, lit==0, blen, bp, blit);
+    Match& m=lz.mt[i-lz.mtstart];
+    m.bp=bp, m.len=blen, m.lit=blit, m.state=1+(lit>0);
+    if (bp<i && blen-blit>=lz.minLen(i-bp))
+      i+=blen, lit=0;
+    else
+      ++i, ++lit;
+    if (lit>=lz.maxLiteral) lit=0;
   }
 }
 
@@ -6670,33 +7086,18 @@ void LZBuffer::fill() {
     unsigned blit=0;  // literals before best match
     int bscore=0;  // best cost
 
-    // Look up contexts in suffix array
+    // Look up contexts in suffix array, or in matches found ahead
     if (isa) {
-      if (sa[isa[i&mask]]!=i) // rebuild ISA
-        for (unsigned j=0; j<n; ++j)
-          if ((sa[j]&~mask)==(i&~mask))
-            isa[sa[j]&mask]=j;
-      for (unsigned h=0; h<=lookahead; ++h) {
-        unsigned q=isa[(h+i)&mask];  // location of h+i in SA
-        assert(q<n);
-        if (sa[q]!=h+i) continue;
-        for (int j=-1; j<=1; j+=2) {  // search backward and forward
-          for (unsigned k=1; k<=bucket; ++k) {
-            unsigned p;  // match to be tested
-            if (q+j*k<n && (p=sa[q+j*k]-h)<i) {
-              assert(p<n);
-              unsigned l, l1;  // length of match, leading literals
-              for (l=h; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
-              for (l1=h; l1>0 && in[p+l1-1]==in[i+l1-1]; --l1);
-              int score=int(l-l1)*8-lg(i-p)-4*(lit==0 && l1>0)-11;
-              for (unsigned a=0; a<h; ++a) score=score*5/8;
-              if (score>bscore) blen=l, bp=p, blit=l1, bscore=score;
-              if (l<blen || l<minMatch || l>255) break;
-            }
-          }
-        }
-        if (bscore<=0 || blen<minMatch) break;
+      if (mt.size() && (i<mtstart || i>=mtend)) findAhead(lit);
+      if (i<mtend && i>=mtstart && mt[i-mtstart].state==1+(lit>0)) {
+        const Match& m=mt[i-mtstart];
+        blen=m.len, bp=m.bp, blit=m.lit;
       }
+      else {
+        loadISA(i);
+        find(i, lit==0, blen, bp, blit);
+      }
+      bscore=bp<i;
     }
 
     // Look up contexts in a hash table.
@@ -6746,8 +7147,7 @@ void LZBuffer::fill() {
     // and then the match. blen is the length of the match.
     assert(i>=bp);
     const unsigned off=i-bp;  // offset
-    if (off>0 && bscore>0
-        && blen-blit>=minMatch+(level==2)*((off>=(1<<16))+(off>=(1<<24)))) {
+    if (off>0 && bscore>0 && blen-blit>=minLen(off)) {
       lit+=blit;
       write_literal(i+blit, lit);
       write_match(blen-blit, off);
@@ -6891,9 +7291,10 @@ std::string makeConfig(const char* method, int args[]) {
 
   // Read "{x|s|i|0}N1,N2...N9" into args[0..8] ($1..$9)
   args[0]=0;  // log block size in MiB
-  args[1]=0;  // 0=none, 1=var-LZ77, 2=byte-LZ77, 3=BWT, 4..7 adds E8E9
-  args[2]=0;  // lz77 minimum match length
-  args[3]=0;  // secondary context length
+  args[1]=0;  // 0=none, 1=var-LZ77, 2=byte-LZ77, 3=BWT, 4..7 adds E8E9,
+              // 8=transpose, 9=word transform
+  args[2]=0;  // lz77 minimum match length or transpose record width
+  args[3]=0;  // secondary context length or 1=transpose with delta
   args[4]=0;  // log searches
   args[5]=0;  // lz77 hash table size or SA if args[0]+21
   args[6]=0;  // secondary context look ahead
@@ -6917,8 +7318,107 @@ std::string makeConfig(const char* method, int args[]) {
   const int level=args[1]&3;
   const bool doe8=args[1]>=4 && args[1]<=7;
 
+  // Transpose fixed width records, with or without delta coding
+  if (args[1]==8) {
+    if (args[2]<1 || args[2]>255)
+      error("transpose record width (N3) must be 1..255");
+    hdr="comp 9 16 0 $1+20 ";
+    pcomp=
+    "pcomp transpose ;\n"
+    "  (store input in M. At EOF put size in R1, rows in R2,\n"
+    "   and size of whole rows in R3, then output by rows)\n"
+    "  a> 255 ifnot\n"
+    "    *b=a b++\n"
+    "  elsel\n"
+    "    a=b r=a 1 a/= $3 r=a 2 a*= $3 r=a 3\n";
+    if (args[3]==1)
+      pcomp+=
+      "\n"
+      "    (undo delta: add the byte before in the column, c = index,\n"
+      "     d = row)\n"
+      "    c=0 d=0 do\n"
+      "      a=r 3 a>c if\n"
+      "        a=d a> 0 if\n"
+      "          b=c b-- a=*b a+=*c *c=a\n"
+      "        endif\n"
+      "        d++ a=r 2 a==d if d=0 endif\n"
+      "      c++ forever\n"
+      "    endif\n";
+    pcomp+=
+    "\n"
+    "    (for each row d, output every b'th byte from c=d)\n"
+    "    a=r 2 b=a d=0 do\n"
+    "      a=b a>d if\n"
+    "        c=d do\n"
+    "          a=r 3 a>c if\n"
+    "            a=*c out a=c a+=b c=a\n"
+    "          forever\n"
+    "        endif\n"
+    "      d++ forever\n"
+    "    endif\n"
+    "\n"
+    "    (output the rest after the last whole row)\n"
+    "    c=r 3 do\n"
+    "      a=r 1 a>c if\n"
+    "        a=*c out c++\n"
+    "      forever\n"
+    "    endif\n"
+    "    b=0\n"
+    "  endif\n"
+    "  halt\n"
+    "end\n";
+  }
+
+  // Replace codes with words and capitalize
+  else if (args[1]==9) {
+    hdr="comp 9 16 8 13 ";
+    pcomp=
+    "pcomp wordpre ;\n"
+    "  (R1 = state: 0=escape code, 1=cap code, 2=number of words,\n"
+    "   3=word code, 4=length, 5=letters, 6=text. R2 = words left,\n"
+    "   R3 = word code, R4 = letters left, R5 = cap code, R6 = 1 to\n"
+    "   capitalize next, 2 to output next as is, R7 = escape code.\n"
+    "   Letters are in M, H[code] = start*256+length)\n"
+    "  a> 255 if (reset at end of segment)\n"
+    "    a=0 r=a 1 r=a 6 b=0 d=0 do *d=0 d++ a=d a> 255 until\n"
+    "    halt\n"
+    "  endif\n"
+    "  c=a a=r 1\n"
+    "  a== 0 if a=c r=a 7 a= 1 r=a 1 halt endif\n"
+    "  a== 1 if a=c r=a 5 a= 2 r=a 1 halt endif\n"
+    "  a== 2 if\n"
+    "    a=c r=a 2 a== 0 if a= 6 else a= 3 endif r=a 1 halt\n"
+    "  endif\n"
+    "  a== 3 if a=c r=a 3 a= 4 r=a 1 halt endif\n"
+    "  a== 4 if\n"
+    "    a=c r=a 4 a=b a<<= 8 a+=c d=r 3 *d=a a= 5 r=a 1 halt\n"
+    "  endif\n"
+    "  a== 5 if\n"
+    "    *b=c b++ a=r 4 a-- r=a 4 a== 0 if\n"
+    "      a=r 2 a-- r=a 2 a== 0 if a= 6 else a= 3 endif r=a 1\n"
+    "    endif\n"
+    "    halt\n"
+    "  endif\n"
+    "\n"
+    "  (text: output escaped bytes, set R6 after escape or cap code,\n"
+    "   output other bytes, or words)\n"
+    "  a=r 6 a== 2 if a=c out a=0 r=a 6 halt endif\n"
+    "  a=r 7 a==c if a= 2 r=a 6 halt endif\n"
+    "  a=r 5 a==c if a= 1 r=a 6 halt endif\n"
+    "  d=c a=*d a== 0 if\n"
+    "    a=r 6 a> 0 if a=c a-= 32 c=a endif\n"
+    "    a=c out a=0 r=a 6 halt\n"
+    "  endif\n"
+    "  a&= 255 b=a a=*d a>>= 8 c=a d=b\n"
+    "  a=r 6 a> 0 if a=*c a-= 32 out c++ d-- endif\n"
+    "  do a=d a> 0 if a=*c out c++ d-- forever endif\n"
+    "  a=0 r=a 6\n"
+    "  halt\n"
+    "end\n";
+  }
+
   // LZ77+Huffman, with or without E8E9
-  if (level==1) {
+  else if (level==1) {
     const int rb=args[0]>4 ? args[0]-4 : 0;
     hdr="comp 9 16 0 $1+20 ";
     pcomp=
@@ -7534,6 +8034,47 @@ std::string makeConfig(const char* method, int args[]) {
   return hdr+itos(ncomp)+"\n"+comp+hcomp+"halt\n"+pcomp;
 }
 
+// Return the width 2..255 of fixed width records in p[0..n-1], or 0 if
+// none are found. In a sample from the middle, the width is the
+// shortest distance at which bytes repeat much more often than at
+// other distances. Set delta if the bytes minus the bytes one row back
+// have lower order 0 entropy in each column than the bytes themselves.
+static int findRecords(const unsigned char* p, unsigned n, bool& delta) {
+  const unsigned N=1<<15;  // sample size
+  if (n<N*2) return 0;
+  const unsigned start=n/2-N/2;
+  int m[256]={0};  // m[k] = number of bytes equal to the byte k back
+  for (unsigned i=start; i<start+N; ++i)
+    for (int k=1; k<256; ++k)
+      m[k]+=p[i]==p[i-k];
+  int w=2;
+  double avg=0;
+  for (int k=2; k<256; ++k) {
+    if (m[k]>m[w]) w=k;
+    avg+=m[k]/254.0;
+  }
+  for (int k=2; k<w; ++k) {  // prefer a factor with nearly as many
+    if (w%k==0 && m[k]*10>=m[w]*9) {
+      w=k;
+      break;
+    }
+  }
+  if (m[w]<avg*3 || m[w]<int(N/4)) return 0;
+
+  // Compare column entropy with and without delta coding
+  Array<int> t(w*512);  // counts of bytes, deltas by column
+  for (unsigned i=start; i<start+N; ++i) {
+    const int c=i%w;
+    ++t[c*512+p[i]];
+    ++t[c*512+256+U8(p[i]-p[i-w])];
+  }
+  double e=0;  // bits with delta - bits without
+  for (int c=0; c<w*512; ++c)
+    if (t[c]>0) e+=t[c]*log(double(t[c]))*(c&256 ? -1 : 1);
+  delta=e<0;
+  return w;
+}
+
 // Compress from in to out in 1 segment in 1 block using the algorithm
 // descried in method. If method begins with a digit then choose
 // a method depending on type. Save filename and comment
@@ -7577,6 +8118,7 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   }
 
   // Expand default methods
+  bool words=false;  // word transform already applied to in?
   if (isdigit(method[0])) {
     const int level=method[0]-'0';
     assert(level>=0 && level<=9);
@@ -7587,10 +8129,23 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
     std::string htsz=","+itos(19+arg0+(arg0<=6));  // lz77 hash table size
     std::string sasz=","+itos(21+arg0);            // lz77 suffix array size
 
+    // Look for fixed width records in binary data
+    bool delta=false;
+    const int width=level>=2 && level<=4 && type>=12 && (type&3)==0
+        ? findRecords(in->data(), n, delta) : 0;
+
     // store uncompressed
     if (level==0)
       method="0"+itos(arg0)+",0";
 
+    // Transpose records into columns and model with fast CM
+    else if (width>0) {
+      method+=",8,"+itos(width)+","+itos(delta);
+      if (level==2) method+="c";
+      else if (level==3) method+="ci1";
+      else method+="ci1,1,1,1,2am";
+    }
+
     // LZ77, no model. Store if hard to compress
     else if (level==1) {
       if (type<40) method+=",0";
@@ -7620,6 +8175,8 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
         method+=",0";
       else if (type<48)  // fast LZ77 if barely compressible
         method+=","+itos(1+doe8)+",4,0,3"+htsz;
+      else if (!doe8 && (words=wordpre(*in, 0.7)))  // repetitive words
+        method+=",9ci1,1,2";
       else if (type>=640 || (type&1))  // BWT if text or highly compressible
         method+=","+itos(3+doe8)+"ci1";
       else  // LZ77 with O0-1 compression of up to 12 literals
@@ -7711,9 +8268,13 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
     co.setInput(&lz);
     co.compress();
   }
-  else {  // compress with e8e9 or no preprocessing
+  else {  // compress with e8e9, transpose, words, or no preprocessing
     if (args[1]>=4 && args[1]<=7)
       e8e9(in->data(), in->size());
+    if (args[1]==8)
+      transpose(in->data(), in->size(), args[2], args[3]==1);
+    if (args[1]==9 && !words)
+      wordpre(*in, 1e30);
     co.setInput(in);
     co.compress();
   }
@@ -7730,4 +8291,332 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   co.endBlock();
 }
 
+
+//////////////////////////// AOT ///////////////////////////////
+
+// List of registered AOTs. It is constructed on first use because AOTs
+// in other files register themselves during static initialization.
+static std::vector<const AOT*>& aotList() {
+  static std::vector<const AOT*> list;
+  return list;
+}
+
+AOT::AOT(const char* k, int n, void (ZPAQL::*r)(U32),
+         int (Predictor::*p)(), void (Predictor::*u)(int)):
+    key(k), keylen(n), run(r), predict(p), update(u) {
+  aotList().push_back(this);
+}
+
+// Return the key of z: "p" ph pm PCOMP if pp, else "h" hh hm ph pm n
+// COMP HCOMP
+static std::string aotKey(ZPAQL& z, bool pp) {
+  std::string k=pp ? "p" : "h";
+  if (pp) k.append((const char*)&z.header[4], 2);
+  else k.append((const char*)&z.header[2], z.cend-2);
+  return k.append((const char*)&z.header[z.hbegin], z.hend-z.hbegin);
+}
+
+const AOT* AOT::find(ZPAQL& z, bool pp) {
+  const std::vector<const AOT*>& list=aotList();
+  if (list.size()==0 || z.header.isize()<=6) return 0;
+  const std::string k=aotKey(z, pp);
+  for (unsigned i=0; i<list.size(); ++i)
+    if (list[i]->keylen==int(k.size())
+        && memcmp(list[i]->key, k.data(), k.size())==0)
+      return list[i];
+  return 0;
+}
+
+// Return C++ for operand i of a ZPAQL instruction (A B C D *B *C *D N)
+static std::string aotOperand(int i, int n) {
+  static const char* opd[7]={"a", "b", "c", "d", "m(b)", "m(c)", "h(d)"};
+  return i<7 ? opd[i] : itos(n);
+}
+
+// Return C++ source of ZPAQL::runAOT<id>(), which does the same as
+// run0() for the HCOMP or PCOMP of z. Registers are held in local
+// variables and jumps become gotos. A jump to anything but the start of
+// an instruction continues with execute() as run0() would.
+static std::string aotRun(ZPAQL& z, int id) {
+  const int hb=z.hbegin, he=z.hend;
+
+  // Find instruction starts and jump targets relative to hb
+  std::vector<char> start(he-hb+1), target(he-hb+1);
+  for (int pc=hb; pc<he;) {
+    const int op=z.header[pc];
+    start[pc-hb]=1;
+    int t=-1;
+    if (op==39 || op==47 || op==63)
+      t=pc+2+((z.header[pc+1]+128)&255)-128;
+    else if (op==255)
+      t=hb+z.header[pc+1]+256*z.header[pc+2];
+    pc+=op==255 ? 3 : (op&7)==7 ? 2 : 1;
+    if (t>=hb && t<he) target[t-hb]=1;
+  }
+
+  std::string s="template<> void ZPAQL::runAOT<"+itos(id)+">(U32 input) {\n"
+      "  U32 a=input, b=this->b, c=this->c, d=this->d;\n"
+      "  int f=this->f;\n";
+  bool halt=false, interp=false;
+  for (int pc=hb; pc<he;) {
+    const int op=z.header[pc];
+    const int n=z.header[pc+1];
+    const int len=op==255 ? 3 : (op&7)==7 ? 2 : 1;
+
+    // Jump to pc+2+N, pc+1+N, or hb+N
+    int t=-1;
+    if (op==39 || op==47 || op==63) t=pc+2+((n+128)&255)-128;
+    else if (op==255) t=hb+n+256*z.header[pc+2];
+    std::string jump;
+    if (t>=hb && t<he && target[t-hb] && start[t-hb])
+      jump="goto L"+itos(t-hb)+";";
+    else if (op==255 && t>=he)
+      jump="err();";
+    else if (t>=0) {
+      jump="{pc="+itos(t)+"; goto interp;}";
+      interp=true;
+    }
+
+    // Translate instruction
+    const int x=op>>3&7, y=op&7;
+    const std::string r=aotOperand(x, n), v=aotOperand(y, n);
+    std::string c;
+    if (op==39) c="if (f) "+jump;
+    else if (op==47) c="if (!f) "+jump;
+    else if (op==55) c="r["+itos(n)+"]=a;";
+    else if (op==56) c="goto halt;", halt=true;
+    else if (op==57) c="outc(a&255);";
+    else if (op==59) c="a=(a+m(b)+512)*773;";
+    else if (op==60) c="h(d)=(h(d)+a+512)*773;";
+    else if (op==63 || op==255) c=jump;
+    else if (op>0 && op<56) {
+      if (y==0) c="a^="+r+"; "+r+"^=a; a^="+r+";";
+      else if (y==1) c="++"+r+";";
+      else if (y==2) c="--"+r+";";
+      else if (y==3) c=r+"=~"+r+";";
+      else if (y==4) c=r+"=0;";
+      else if (y==7 && x<4) c=r+"=r["+itos(n)+"];";
+      else c="err();";
+    }
+    else if (op>=64 && op<120) {  // X=Y
+      if (x!=y) c=r+"="+v+";";
+    }
+    else if (op>=128 && op<240) {  // A op Y
+      switch ((op-128)>>3) {
+        case 0: c="a+="+v+";"; break;
+        case 1: c="a-="+v+";"; break;
+        case 2: c="a*="+v+";"; break;
+        case 3: c="if ("+v+") a/="+v+"; else a=0;"; break;
+        case 4: c="if ("+v+") a%="+v+"; else a=0;"; break;
+        case 5: c="a&="+v+";"; break;
+        case 6: c="a&=~"+v+";"; break;
+        case 7: c="a|="+v+";"; break;
+        case 8: c="a^="+v+";"; break;
+        case 9: c="a<<=("+v+"&31);"; break;
+        case 10: c="a>>=("+v+"&31);"; break;
+        case 11: c="f=(a==U32("+v+"));"; break;
+        case 12: c="f=(a<U32("+v+"));"; break;
+        case 13: c="f=(a>U32("+v+"));"; break;
+      }
+    }
+    else c="err();";
+    if (target[pc-hb]) s+="L"+itos(pc-hb)+":\n";
+    if (c!="") s+="  "+c+"\n";
+    pc+=len;
+  }
+  s+="  err();\n";
+  if (halt)
+    s+="halt:\n"
+       "  this->a=a, this->b=b, this->c=c, this->d=d, this->f=f;\n"
+       "  return;\n";
+  if (interp)
+    s+="interp:\n"
+       "  this->a=a, this->b=b, this->c=c, this->d=d, this->f=f;\n"
+       "  while (execute()) ;\n";
+  return s+"}\n\n";
+}
+
+// Return s with $i replaced by i and $1...$5 by cp[1]...cp[5]
+static std::string aotSubst(const char* s, int i, const U8* cp) {
+  std::string r;
+  for (; *s; ++s) {
+    if (s[0]=='$' && s[1]=='i') r+=itos(i), ++s;
+    else if (s[0]=='$' && s[1]>='1' && s[1]<='5') r+=itos(cp[s[1]-'0']), ++s;
+    else r+=*s;
+  }
+  return r;
+}
+
+// Return C++ source of Predictor::predictAOT<id>() and updateAOT<id>(),
+// which do the same as predict0() and update0() for the COMP of z.
+// Each component is unrolled with its type and arguments as constants.
+static std::string aotPredict(ZPAQL& z, int id) {
+
+  // Component code by type in predict0() and update0() order
+  static const char* pcode[10]={
+    "",  // NONE
+    "",  // CONS
+    "cr.cxt=h[$i]^hmap4;\n"  // CM
+    "p[$i]=stretch(cr.cm(cr.cxt)>>17);\n",
+    "if (c8==1 || (c8&0xf0)==16) cr.c=find(cr.ht, $1+2, h[$i]+16*c8);\n"
+    "cr.cxt=cr.ht[cr.c+(hmap4&15)];\n"  // ICM
+    "p[$i]=stretch(cr.cm(cr.cxt)>>8);\n",
+    "if (cr.a==0) p[$i]=0;\n"  // MATCH
+    "else {\n"
+    "  cr.c=(cr.ht(cr.limit-cr.b)>>(7-cr.cxt))&1;\n"
+    "  p[$i]=stretch(dt2k[cr.a]*(cr.c*-2+1)&32767);\n"
+    "}\n",
+    "p[$i]=(p[$1]*$3+p[$2]*(256-$3))>>8;\n",  // AVG
+    "cr.cxt=((h[$i]+(c8&$5))&(cr.c-1));\n"  // MIX2
+    "int w=cr.a16[cr.cxt];\n"
+    "p[$i]=(w*p[$2]+(65536-w)*p[$3])>>16;\n",
+    "cr.cxt=h[$i]+(c8&$5);\n"  // MIX
+    "cr.cxt=(cr.cxt&(cr.c-1))*$3;\n"
+    "int* wt=(int*)&cr.cm[cr.cxt];\n"
+    "int sum=0;\n"
+    "for (int j=0; j<$3; ++j)\n"
+    "  sum+=(wt[j]>>8)*p[$2+j];\n"
+    "p[$i]=clamp2k(sum>>8);\n",
+    "if (c8==1 || (c8&0xf0)==16) cr.c=find(cr.ht, $1+2, h[$i]+16*c8);\n"
+    "cr.cxt=cr.ht[cr.c+(hmap4&15)];\n"  // ISSE
+    "int* wt=(int*)&cr.cm[cr.cxt*2];\n"
+    "p[$i]=clamp2k((wt[0]*p[$2]+wt[1]*64)>>16);\n",
+    "cr.cxt=(h[$i]+c8)*32;\n"  // SSE
+    "int pq=p[$2]+992;\n"
+    "if (pq<0) pq=0;\n"
+    "if (pq>1983) pq=1983;\n"
+    "int wt=pq&63;\n"
+    "pq>>=6;\n"
+    "cr.cxt+=pq;\n"
+    "p[$i]=stretch(((cr.cm(cr.cxt)>>10)*(64-wt)"
+    "+(cr.cm(cr.cxt+1)>>10)*wt)>>13);\n"
+    "cr.cxt+=wt>>5;\n"};
+  static const char* ucode[10]={
+    "",  // NONE
+    "",  // CONS
+    "train(cr, y);\n",  // CM
+    "cr.ht[cr.c+(hmap4&15)]=st.next(cr.ht[cr.c+(hmap4&15)], y);\n"
+    "U32& pn=cr.cm(cr.cxt);\n"  // ICM
+    "pn+=int(y*32767-(pn>>8))>>2;\n",
+    "if (int(cr.c)!=y) cr.a=0;\n"  // MATCH
+    "cr.ht(cr.limit)+=cr.ht(cr.limit)+y;\n"
+    "if (++cr.cxt==8) {\n"
+    "  cr.cxt=0;\n"
+    "  ++cr.limit;\n"
+    "  cr.limit&=(1<<$2)-1;\n"
+    "  if (cr.a==0) {\n"
+    "    cr.b=cr.limit-cr.cm(h[$i]);\n"
+    "    if (cr.b&(cr.ht.size()-1))\n"
+    "      while (cr.a<255\n"
+    "             && cr.ht(cr.limit-cr.a-1)==cr.ht(cr.limit-cr.a-cr.b-1))\n"
+    "        ++cr.a;\n"
+    "  }\n"
+    "  else cr.a+=cr.a<255;\n"
+    "  cr.cm(h[$i])=cr.limit;\n"
+    "}\n",
+    "",  // AVG
+    "int err=(y*32767-squash(p[$i]))*$4>>5;\n"  // MIX2
+    "int w=cr.a16[cr.cxt];\n"
+    "w+=(err*(p[$2]-p[$3])+(1<<12))>>13;\n"
+    "if (w<0) w=0;\n"
+    "if (w>65535) w=65535;\n"
+    "cr.a16[cr.cxt]=w;\n",
+    "int err=(y*32767-squash(p[$i]))*$4>>4;\n"  // MIX
+    "int* wt=(int*)&cr.cm[cr.cxt];\n"
+    "for (int j=0; j<$3; ++j)\n"
+    "  wt[j]=clamp512k(wt[j]+((err*p[$2+j]+(1<<12))>>13));\n",
+    "int err=y*32767-squash(p[$i]);\n"  // ISSE
+    "int* wt=(int*)&cr.cm[cr.cxt*2];\n"
+    "wt[0]=clamp512k(wt[0]+((err*p[$2]+(1<<12))>>13));\n"
+    "wt[1]=clamp512k(wt[1]+((err+16)>>5));\n"
+    "cr.ht[cr.c+(hmap4&15)]=st.next(cr.cxt, y);\n",
+    "train(cr, y);\n"};  // SSE
+
+  // Indent each line of code by 4 in a block with cr=comp[i]
+  const int n=z.header[6];
+  std::string ps, us;
+  const U8* cp=&z.header[7];
+  for (int i=0; i<n; ++i) {
+    if (cp[0]<1 || cp[0]>9) error("AOT: bad component");
+    for (int k=0; k<2; ++k) {
+      const std::string c=aotSubst(k ? ucode[cp[0]] : pcode[cp[0]], i, cp);
+      if (c=="") continue;
+      std::string& s=k ? us : ps;
+      s+="  {  // "+itos(i)+"\n    Component& cr=comp["+itos(i)+"];\n    ";
+      for (unsigned j=0; j<c.size(); ++j)
+        s+=c[j]=='\n' && j+1<c.size() ? "\n    " : std::string(1, c[j]);
+      s+="  }\n";
+    }
+    cp+=compsize[cp[0]];
+  }
+  return "template<> int Predictor::predictAOT<"+itos(id)+">() {\n"
+      +ps+"  return squash(p["+itos(n-1)+"]);\n}\n\n"
+      "template<> void Predictor::updateAOT<"+itos(id)+">(int y) {\n"
+      +us+
+      "  c8+=c8+y;\n"
+      "  if (c8>=256) {\n"
+      "    z.run(c8-256);\n"
+      "    hmap4=1;\n"
+      "    c8=1;\n"
+      "    for (int i=0; i<"+itos(n)+"; ++i) h[i]=z.H(i);\n"
+      "  }\n"
+      "  else if (c8>=16 && c8<32)\n"
+      "    hmap4=(hmap4&0xf)<<5|y<<4|1;\n"
+      "  else\n"
+      "    hmap4=(hmap4&0x1f0)|(((hmap4&0xf)*2+y)&0xf);\n"
+      "}\n\n";
+}
+
+// Return C++ source that registers key k with the code for id
+static std::string aotRegister(const std::string& k, int id, bool model) {
+  std::string s="static const U8 key"+itos(id)+"[]={";
+  for (unsigned i=0; i<k.size(); ++i)
+    s+=std::string(i%16 ? " " : "\n  ")+itos(k[i]&255)+",";
+  s+="\n  0};\nstatic const AOT aot"+itos(id)+"((const char*)key"+itos(id)+", "
+      +itos(k.size())+", &ZPAQL::runAOT<"+itos(id)+">";
+  if (model)
+    s+=",\n    &Predictor::predictAOT<"+itos(id)+">, "
+       "&Predictor::updateAOT<"+itos(id)+">";
+  return s+");\n\n";
+}
+
+// Return a positive hash of k to name its code
+static int aotId(const std::string& k) {
+  U32 h=2166136261u;
+  for (unsigned i=0; i<k.size(); ++i) h=(h^(k[i]&255))*16777619;
+  return h&0x7fffffff;
+}
+
+void compileAOT(const char* method, Writer* out) {
+  assert(method);
+  assert(out);
+  if (method[0]!='x' && method[0]!='s')
+    error("AOT method must start with x or s");
+  int args[9]={0};
+  std::string config=makeConfig(method, args);
+  ZPAQL hz, pz;
+  StringBuffer pcomp_cmd;
+  Compiler(config.c_str(), args, hz, pz, &pcomp_cmd);
+
+  // Write the config as a comment, then the code for HCOMP and PCOMP
+  std::string s="// Generated by compileAOT(\""+std::string(method)+"\")\n//\n";
+  for (unsigned i=0; i<config.size(); ++i) {
+    if (i==0 || config[i-1]=='\n') s+="// ";
+    s+=config[i];
+  }
+  s+="\n#include \"libzpaq.h\"\n\nnamespace libzpaq {\n\n";
+  const std::string hk=aotKey(hz, false);
+  const int hid=aotId(hk), n=hz.header[6];
+  s+=aotRun(hz, hid);
+  if (n>0) s+=aotPredict(hz, hid);
+  s+=aotRegister(hk, hid, n>0);
+  if (pz.hend>pz.hbegin) {
+    const std::string pk=aotKey(pz, true);
+    const int pid=aotId(pk);
+    s+=aotRun(pz, pid)+aotRegister(pk, pid, false);
+  }
+  s+="}  // end namespace libzpaq\n";
+  out->write(s.c_str(), s.size());
+}
+
 }  // end namespace libzpaq
@@ -119,9 +119,11 @@ processing (LZ77, BWT, E8E9), and remaining commands describe the
 context model, if any, of the transformed data. The arguments to "x" are:
 
   N1: 0..11 = block size as before.
-  N2: 0..7: 0=none, 1=packed LZ77, 2=LZ77, 3=BWT, 4..7 = 0..3 + E8E9.
-  N3: 4..63: LZ77 min match.
-  N4: LZ77 secondary match to try first or 0 to skip.
+  N2: 0..9: 0=none, 1=packed LZ77, 2=LZ77, 3=BWT, 4..7 = 0..3 + E8E9,
+      8=transpose, 9=word transform.
+  N3: 4..63: LZ77 min match, or 1..255: transpose record width.
+  N4: LZ77 secondary match to try first or 0 to skip, or 1: transpose
+      with delta coding.
   N5: LZ77 log search depth.
   N6: LZ77 log hash table size, or N1+21 to use a suffix array.
   N7: LZ77 lookahead.
@@ -148,6 +150,25 @@ block to the middle 3 bytes interpreted as a little-endian (LSB first)
 number (mod 2^24). E8 and E9 are the CALL and JMP instructions, followed
 by a 32 bit relative offset.
 
+N2 = 8 transposes the block as rows of N3 bytes into N3 columns, so that
+the first bytes of all rows come first, then the second bytes, and so on.
+Any bytes after the last whole row are not moved. If N4 = 1, then each
+byte of a row after the first is replaced by its difference (mod 256)
+from the byte above it before transposing. This makes tables of fixed
+width binary records, such as measurements or database exports, easy to
+compress with a low order context model. compress() and compressBlock()
+select it at levels 2..4 for binary data in which bytes repeat most
+often at some distance 2..255.
+
+N2 = 9 replaces the most frequent words of 2 to 32 lower case letters
+with single bytes chosen from the rarest non-letters, and capitalized
+words with a capital code followed by the word in lower case. Other
+bytes used as codes are escaped. The dictionary is built for each block
+and stored at the start of the transformed data. This suits text with
+a small, repetitive vocabulary such as logs. compressBlock() selects it
+with an ICM and an ISSE chain of orders 1, 2, and 4 at level 3 when the
+transform shrinks the block by at least 30%.
+
 N3..N7 apply only to LZ77. For either type, it searches for matches
 by hashing the next N4 bytes, and then the next N3 bytes, and looking
 up each of the hashes at 2^N5 locations in a table with 2^N6 entries.
@@ -293,6 +314,13 @@ a single block, regardless of the N1 (block size) argument in the method.
                      const char* filename=0, const char* comment=0,
                      bool compute_sha1=false);
 
+An application with threads to spare may set the function pointer
+libzpaq::parallelFor. LZ77 with a suffix array then uses it to search
+for matches in several parts of a block at once. The output does not
+change.
+
+  extern int (*parallelFor)(void (*f)(void*, int), void* arg, int n);
+
 A StringBuffer is both a Reader and a Writer, but also allows random
 memory access. It provides convenient and efficient storage when the
 input size is unknown.
@@ -775,6 +803,21 @@ rather than overflow if n << e would require more than 32 bits. If
 compiled with -DDEBUG, then bounds are checked at run time.
 
 
+AHEAD OF TIME COMPILATION
+
+  void compileAOT(const char* method, Writer* out);
+
+compileAOT() writes C++ source to out that implements the context model,
+HCOMP and PCOMP of method, which must start with "x" or "s" as described
+above. Compiling the source and linking it into a program with libzpaq
+registers the code at startup. Any Compressor or Decompresser block whose
+COMP and HCOMP, or PCOMP, exactly match the method then runs the compiled
+code instead of the JIT or interpreter. Blocks with other headers are
+not affected. Each source can be compiled with the program's own options,
+so the C++ compiler can inline and vectorize the model for the target.
+Several sources can be linked together.
+
+
 ENCRYPTION
 
 There is a class libzpaq::SHA256 with put(), result(), size(), and usize()
@@ -878,6 +921,12 @@ public:
 // Read 16 bit little-endian number
 int toU16(const char* p);
 
+// Allocate n bytes cleared to 0 or return 0 if out of memory. Free p
+// allocated by allocz(n). Large blocks are mapped directly from the OS,
+// so their pages are zeroed only when first touched.
+void* allocz(size_t n);
+void freez(void* p, size_t n);
+
 // An Array of T is cleared and aligned on a 64 byte address
 //   with no constructors called. No copy or assignment.
 // Array<T> a(n, ex=0);  - creates n<<ex elements of type T
@@ -913,7 +962,7 @@ void Array<T>::resize(size_t sz, int ex) {
   if (n>0) {
     assert(offset>0 && offset<=64);
     assert((char*)data-offset);
-    ::free((char*)data-offset);
+    freez((char*)data-offset, 128+n*sizeof(T));
   }
   n=0;
   offset=0;
@@ -921,7 +970,7 @@ void Array<T>::resize(size_t sz, int ex) {
   n=sz;
   const size_t nb=128+n*sizeof(T);  // test for overflow
   if (nb<=128 || (nb-128)/sizeof(T)!=n) n=0, error("Array too big");
-  data=(T*)::calloc(nb, 1);
+  data=(T*)allocz(nb);
   if (!data) n=0, error("Out of memory");
   offset=64-(((char*)data-(char*)0)&63);
   assert(offset>0 && offset<=64);
@@ -1020,6 +1069,7 @@ void random(char* buf, int n);
 typedef enum {NONE,CONS,CM,ICM,MATCH,AVG,MIX2,MIX,ISSE,SSE} CompType;
 extern const int compsize[256];
 class Decoder;  // forward
+struct AOT;     // forward
 
 // A ZPAQL machine COMP+HCOMP or PCOMP.
 class ZPAQL {
@@ -1034,6 +1084,7 @@ public:
   int read(Reader* in2);  // Read header
   bool write(Writer* out2, bool pp); // If pp write PCOMP else HCOMP header
   int step(U32 input, int mode);  // Trace execution (defined externally)
+  template <int N> void runAOT(U32 input);  // Defined by compileAOT()
 
   Writer* output;         // Destination for OUT instruction, or 0 to suppress
   SHA1* sha1;             // Points to checksum computer
@@ -1061,6 +1112,7 @@ private:
   int pc;             // program counter
   int rcode_size;     // length of rcode
   U8* rcode;          // JIT code for run()
+  const AOT* aot;     // compiled code for run() or 0
 
   // Support code
   int assemble();  // put JIT code in rcode
@@ -1121,6 +1173,8 @@ public:
   int predict();        // probability that next bit is a 1 (0..4095)
   void update(int y);   // train on bit y (0..1)
   int stat(int);        // Defined externally
+  template <int N> int predictAOT();      // Defined by compileAOT()
+  template <int N> void updateAOT(int y);
   bool isModeled() {    // n>0 components?
     assert(z.header.isize()>6);
     return z.header[6]!=0;
@@ -1146,6 +1200,7 @@ private:
   StateTable st;        // next, cminit functions
   U8* pcode;            // JIT code for predict() and update()
   int pcode_size;       // length of pcode
+  const AOT* aot;       // compiled predict() and update() or 0
 
   // reduce prediction error in cr.cm
   void train(Component& cr, int y) {
@@ -1191,6 +1246,22 @@ private:
   int assemble_p();
 };
 
+///////////////////////////// AOT ////////////////////////////
+
+// Code written by compileAOT() for one HCOMP (with run, predict and
+// update) or PCOMP (with run only). Constructing an AOT registers it.
+// find() returns the one whose key matches z, or 0 if none.
+struct AOT {
+  const char* key;  // ph pm PCOMP, or hh hm ph pm n COMP HCOMP if predict
+  int keylen;       // length of key
+  void (ZPAQL::*run)(U32 input);
+  int (Predictor::*predict)();
+  void (Predictor::*update)(int y);
+  AOT(const char* k, int n, void (ZPAQL::*r)(U32),
+      int (Predictor::*p)()=0, void (Predictor::*u)(int)=0);
+  static const AOT* find(ZPAQL& z, bool pp);
+};
+
 //////////////////////////// Decoder /////////////////////////
 
 // Decoder decompresses using an arithmetic code
@@ -1219,6 +1290,7 @@ private:
   enum {BUFSIZE=1<<16};
   Array<char> buf;   // input buffer of size BUFSIZE bytes
   int decode(int p); // return decoded bit (0..1) with prob. p (0..65535)
+  void shift();      // shift identical leading bytes of low and high
 };
 
 /////////////////////////// PostProcessor ////////////////////
@@ -1273,16 +1345,20 @@ void decompress(Reader* in, Writer* out);
 class Encoder {
 public:
   Encoder(ZPAQL& z, int size=0):
-    out(0), low(1), high(0xFFFFFFFF), pr(z) {}
+    out(0), low(1), high(0xFFFFFFFF), opos(0), pr(z) {}
   void init();
   void compress(int c);  // c is 0..255 or EOF
   int stat(int x) {return pr.stat(x);}
   Writer* out;  // destination
 private:
   U32 low, high; // range
+  U32 opos;      // bytes of modeled output waiting in obuf
   Predictor pr;  // to get p
   Array<char> buf; // unmodeled input
+  enum {BUFSIZE=1<<16};
+  Array<char> obuf;  // modeled output of size BUFSIZE, written at EOS
   void encode(int y, int p); // encode bit y (0..1) with prob. p (0..65535)
+  void shift();      // write identical leading bytes of low and high
 };
 
 //////////////////////////// Compiler ////////////////////////
@@ -1505,6 +1581,14 @@ void compress(Reader* in, Writer* out, const char* method,
 void compressBlock(StringBuffer* in, Writer* out, const char* method,
      const char* filename=0, const char* comment=0, bool dosha1=true);
 
+// If not 0, LZ77 with a suffix array calls parallelFor(f, arg, n) to run
+// f(arg, 0)...f(arg, n-1) in any order, possibly at the same time in
+// other threads, and return the number of threads used after all return.
+extern int (*parallelFor)(void (*f)(void*, int), void* arg, int n);
+
+// Write C++ source implementing the model and postprocessor of method.
+void compileAOT(const char* method, Writer* out);
+
 }  // namespace libzpaq
 
 #endif  // LIBZPAQ_H
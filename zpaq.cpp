@@ -52,6 +52,9 @@ Possible options:
   /EHsc      Enable exception handing in VC++ (required).
   advapi32.lib  Required for libzpaq in VC++.
 
+Models written by "zpaq compile model.cpp -method x..." are linked by
+adding model.cpp to the list of source files, or with make AOT=model.cpp
+
 */
 #define _FILE_OFFSET_BITS 64  // In Linux make sizeof(off_t) == 8
 #ifndef UNICODE
@@ -62,10 +65,12 @@ Possible options:
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 #include <time.h>
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <deque>
 #include <map>
 #include <algorithm>
 #include <stdexcept>
@@ -181,7 +186,7 @@ public:
     assert(sem>=0);
     pthread_mutex_lock(&mutex);
     int r=0;
-    if (sem==0) r=pthread_cond_wait(&cv, &mutex);
+    while (sem==0 && r==0) r=pthread_cond_wait(&cv, &mutex);
     assert(sem>0);
     --sem;
     pthread_mutex_unlock(&mutex);
@@ -444,6 +449,24 @@ int64_t ftello(FP fp) {
 
 #endif
 
+// Return a file for writing to standard output and send anything else
+// printed there to stderr instead. For extract -stdout.
+FP stdoutData() {
+  fflush(stdout);
+#ifdef unix
+  const int fd=dup(1);
+  FP fp=fd<0 ? FPNULL : fdopen(fd, WB);
+  if (fp==FPNULL || dup2(2, 1)<0) error("cannot redirect stdout");
+#else
+  FP fp=FPNULL;
+  if (!DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_OUTPUT_HANDLE),
+      GetCurrentProcess(), &fp, 0, FALSE, DUPLICATE_SAME_ACCESS)
+      || _dup2(_fileno(stderr), _fileno(stdout))<0)
+    error("cannot redirect stdout");
+#endif
+  return fp;
+}
+
 // Return true if a file or directory (UTF-8 without trailing /) exists.
 bool exists(string filename) {
   int len=filename.size();
@@ -572,27 +595,6 @@ void makepath(string path, int64_t date=0, int64_t attr=0) {
   close(filename.c_str(), date, attr);
 }
 
-#ifndef unix
-
-// Truncate filename to length. Return -1 if error, else 0.
-int truncate(const char* filename, int64_t length) {
-  std::wstring w=utow(filename);
-  HANDLE out=CreateFile(w.c_str(), GENERIC_READ | GENERIC_WRITE,
-                        0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-  if (out!=INVALID_HANDLE_VALUE) {
-    LONG hi=length>>32;
-    if (SetFilePointer(out, length, &hi, FILE_BEGIN)
-             !=INVALID_SET_FILE_POINTER
-        && SetEndOfFile(out)
-        && CloseHandle(out))
-      return 0;
-  }
-  return -1;
-}
-#endif
-
-/////////////////////////////// Archive ///////////////////////////////
-
 // Convert non-negative decimal number x to string of at least n digits
 string itos(int64_t x, int n=1) {
   assert(x>=0);
@@ -613,29 +615,733 @@ string subpart(string fn, int part) {
   return fn;
 }
 
+////////////////////////////// Storage ////////////////////////////////
+
+// A StorageReader reads byte ranges of one stored object
+class StorageReader {
+public:
+  virtual ~StorageReader() {}
+
+  // Read up to n bytes at offset off into buf. Return the number read,
+  // 0 at end. Fewer than n may be read before the end.
+  virtual int read(int64_t off, char* buf, int n)=0;
+};
+
+// A StorageWriter updates one stored object. Deleting it without
+// commit() abandons the update, if the backend allows.
+class StorageWriter {
+public:
+  virtual ~StorageWriter() {}
+
+  // Return the size of the object including writes so far
+  virtual int64_t size()=0;
+
+  // Read up to n bytes at offset off into buf. Return the number read.
+  virtual int read(int64_t off, char* buf, int n)=0;
+
+  // Write buf[0..n-1] at offset off. Return true if successful.
+  virtual bool write(int64_t off, const char* buf, int n)=0;
+
+  // Cut off the object after n bytes. Return true if successful.
+  virtual bool truncate(int64_t n)=0;
+
+  // Finish writing and close. Return true if successful.
+  virtual bool commit()=0;
+};
+
+// A Storage holds archive parts and index files as named objects.
+// InputArchive and OutputArchive reach them only through the global
+// storage, which is the local file system unless -storage or -stripe
+// selects another backend. Each reader is independent, so the threads
+// of extract fetch the blocks they decompress in parallel.
+class Storage {
+public:
+  virtual ~Storage() {}
+
+  // Return the size of object name, or -1 if it does not exist
+  virtual int64_t size(const string& name)=0;
+
+  // Open name for reading. Return 0 if it does not exist.
+  virtual StorageReader* open(const string& name)=0;
+
+  // Open name for update, creating it if needed. Return 0 if error.
+  virtual StorageWriter* update(const string& name)=0;
+
+  // Delete name. Return true if successful.
+  virtual bool remove(const string& name)=0;
+
+  // Append to names and sizes the objects whose names start with prefix
+  virtual void list(const string& prefix, vector<string>& names,
+                    vector<int64_t>& sizes)=0;
+
+  // Read up to n bytes of name at offset off into buf. Return the
+  // number read or -1 if name does not exist.
+  int read(const string& name, int64_t off, char* buf, int n) {
+    StorageReader* in=open(name);
+    if (!in) return -1;
+    const int r=in->read(off, buf, n);
+    delete in;
+    return r;
+  }
+
+  // Put in names and sizes the parts of archive fn. If fn has wildcards
+  // then they are numbered from 1 up to the first one missing.
+  void parts(const string& fn, vector<string>& names,
+             vector<int64_t>& sizes);
+};
+
+void Storage::parts(const string& fn, vector<string>& names,
+                    vector<int64_t>& sizes) {
+  names.clear();
+  sizes.clear();
+  const string part0=subpart(fn, 0);
+  if (part0==fn) {  // single part
+    const int64_t sz=size(fn);
+    if (sz>=0) names.push_back(fn), sizes.push_back(sz);
+    return;
+  }
+  vector<string> ln;
+  vector<int64_t> ls;
+  list(fn.substr(0, fn.find_first_of("?*")), ln, ls);
+  map<string, int64_t> found;
+  for (unsigned i=0; i<ln.size(); ++i) found[ln[i]]=ls[i];
+  for (unsigned i=1; ; ++i) {
+    const string parti=subpart(fn, i);
+    map<string, int64_t>::const_iterator p=found.find(parti);
+    if ((i>1 && parti==part0) || p==found.end()) break;
+    names.push_back(parti);
+    sizes.push_back(p->second);
+  }
+}
+
+// Append to names and sizes the regular files in directory dir
+// (ending with / or "" for the current directory) whose names start
+// with prefix. Names do not include dir.
+void listDir(const string& dir, const string& prefix,
+             vector<string>& names, vector<int64_t>& sizes) {
+#ifdef unix
+  DIR* dirp=opendir(dir=="" ? "." : dir.c_str());
+  if (!dirp) return;
+  for (dirent* dp=readdir(dirp); dp; dp=readdir(dirp)) {
+    struct stat sb;
+    if (!strncmp(dp->d_name, prefix.c_str(), prefix.size())
+        && !stat((dir+dp->d_name).c_str(), &sb) && S_ISREG(sb.st_mode)) {
+      names.push_back(dp->d_name);
+      sizes.push_back(sb.st_size);
+    }
+  }
+  closedir(dirp);
+#else
+  WIN32_FIND_DATA ffd;
+  HANDLE h=FindFirstFile(utow((dir+prefix+"*").c_str()).c_str(), &ffd);
+  while (h!=INVALID_HANDLE_VALUE) {
+    if (!(ffd.dwFileAttributes&FILE_ATTRIBUTE_DIRECTORY)) {
+      names.push_back(wtou(ffd.cFileName));
+      sizes.push_back(ffd.nFileSizeLow+(int64_t(ffd.nFileSizeHigh)<<32));
+    }
+    if (!FindNextFile(h, &ffd)) break;
+  }
+  if (h!=INVALID_HANDLE_VALUE) FindClose(h);
+#endif
+}
+
+// Return object name as a file name without directories by writing
+// / \ : and % as %XX
+string escapeName(const string& name) {
+  static const char hex[]="0123456789ABCDEF";
+  string r;
+  for (unsigned i=0; i<name.size(); ++i) {
+    const int c=name[i]&255;
+    if (c=='/' || c=='\\' || c==':' || c=='%')
+      r+='%', r+=hex[c>>4], r+=hex[c&15];
+    else r+=char(c);
+  }
+  return r;
+}
+
+// Return the name of the object holding archive file name with -storage
+// or -stripe. Directories are dropped, so that st/a.zpaq, ./st/a.zpaq,
+// and a.zpaq run from st all name the same object.
+string objectName(const string& name) {
+  return name.substr(name.find_last_of("/\\")+1);
+}
+
+// Inverse of escapeName()
+string unescapeName(const string& s) {
+  string r;
+  for (unsigned i=0; i<s.size(); ++i) {
+    if (s[i]=='%' && i+2<s.size()) {
+      r+=char(strtol(s.substr(i+1, 2).c_str(), 0, 16));
+      i+=2;
+    }
+    else r+=s[i];
+  }
+  return r;
+}
+
+// Return the size of file name or -1 if it does not exist
+int64_t fileSize(const string& name) {
+  FP fp=fopen(name.c_str(), RB);
+  if (fp==FPNULL) return -1;
+  fseeko(fp, 0, SEEK_END);
+  const int64_t r=ftello(fp);
+  fclose(fp);
+  return r;
+}
+
+// Open file name for reading and writing, creating it if needed
+FP fopenUpdate(const string& name) {
+  FP fp=fopen(name.c_str(), RBPLUS);
+  if (fp==FPNULL) fp=fopen(name.c_str(), WBPLUS);
+  return fp;
+}
+
+// Cut off open file fp after n bytes. Return true if successful.
+bool truncateFile(FP fp, int64_t n) {
+#ifdef unix
+  fflush(fp);
+  return ftruncate(fileno(fp), n)==0;
+#else
+  fseeko(fp, n, SEEK_SET);
+  return SetEndOfFile(fp)!=0;
+#endif
+}
+
+// Read a local file, seeking only when not reading sequentially
+class FileReader: public StorageReader {
+  FP fp;
+  int64_t pos;  // file offset
+public:
+  FileReader(FP f): fp(f), pos(0) {}
+  ~FileReader() {fclose(fp);}
+  int read(int64_t off, char* buf, int n) {
+    if (off!=pos) fseeko(fp, off, SEEK_SET);
+    const int r=fread(buf, 1, n, fp);
+    pos=off+r;
+    return r;
+  }
+};
+
+// Update a local file in place
+class FileWriter: public StorageWriter {
+protected:
+  FP fp;        // open file or FPNULL after commit
+  int64_t pos;  // file offset after last write or -1 if unknown
+public:
+  FileWriter(FP f): fp(f), pos(-1) {}
+  ~FileWriter() {if (fp!=FPNULL) fclose(fp);}
+  int64_t size() {
+    fseeko(fp, 0, SEEK_END);
+    return pos=ftello(fp);
+  }
+  int read(int64_t off, char* buf, int n) {
+    fseeko(fp, off, SEEK_SET);
+    pos=-1;  // seek again before writing
+    return fread(buf, 1, n, fp);
+  }
+  bool write(int64_t off, const char* buf, int n) {
+    if (off!=pos) fseeko(fp, off, SEEK_SET);
+    pos=off+n;
+    return fwrite(buf, 1, n, fp)==size_t(n);
+  }
+  bool truncate(int64_t n) {
+    pos=-1;
+    return truncateFile(fp, n);
+  }
+  bool commit() {
+    const bool r=fclose(fp)==0;
+    fp=FPNULL;
+    return r;
+  }
+};
+
+// LocalStorage keeps each object in the file of the same name.
+// An update is written in place.
+class LocalStorage: public Storage {
+public:
+  int64_t size(const string& name) {return fileSize(name);}
+  StorageReader* open(const string& name) {
+    FP fp=fopen(name.c_str(), RB);
+    return fp==FPNULL ? 0 : new FileReader(fp);
+  }
+  StorageWriter* update(const string& name) {
+    FP fp=fopenUpdate(name);
+    return fp==FPNULL ? 0 : new FileWriter(fp);
+  }
+  bool remove(const string& name) {return delete_file(name.c_str());}
+  void list(const string& prefix, vector<string>& names,
+            vector<int64_t>& sizes);
+};
+
+void LocalStorage::list(const string& prefix, vector<string>& names,
+                        vector<int64_t>& sizes) {
+  const unsigned n=names.size();
+  const string dir=prefix.substr(0, prefix.find_last_of("/\\")+1);
+  listDir(dir, prefix.substr(dir.size()), names, sizes);
+  for (unsigned i=n; i<names.size(); ++i) names[i]=dir+names[i];
+}
+
+// DirStorage stands in for an object store, for testing. Objects are
+// files in one directory named by escapeName() of objectName(). Like an
+// object store, an object cannot be changed in place. An update is made to a copy
+// with the suffix .tmp which replaces it by renaming on commit.
+class DirStorage: public Storage {
+  string dir;  // ending with /
+  string file(const string& name) {
+    return dir+escapeName(objectName(name));
+  }
+
+  // Write to tmp and rename it to fn on commit or delete it if not
+  class Writer: public FileWriter {
+    const string fn, tmp;
+  public:
+    Writer(FP f, const string& fn_): FileWriter(f), fn(fn_), tmp(fn_+".tmp")
+        {}
+    ~Writer() {
+      if (fp!=FPNULL) fclose(fp), fp=FPNULL, delete_file(tmp.c_str());
+    }
+    bool commit();
+  };
+public:
+  DirStorage(): dir("./") {}
+  void setdir(const char* d) {
+    dir=d;
+    if (dir=="" || (dir[dir.size()-1]!='/' && dir[dir.size()-1]!='\\'))
+      dir+="/";
+  }
+  int64_t size(const string& name) {return fileSize(file(name));}
+  StorageReader* open(const string& name) {
+    FP fp=fopen(file(name).c_str(), RB);
+    return fp==FPNULL ? 0 : new FileReader(fp);
+  }
+  StorageWriter* update(const string& name);
+  bool remove(const string& name) {return delete_file(file(name).c_str());}
+  void list(const string& prefix, vector<string>& names,
+            vector<int64_t>& sizes);
+};
+
+bool DirStorage::Writer::commit() {
+  if (!FileWriter::commit()) return false;
+#ifdef unix
+  return rename(tmp.c_str(), fn.c_str())==0;
+#else
+  return MoveFileEx(utow(tmp.c_str()).c_str(), utow(fn.c_str()).c_str(),
+                    MOVEFILE_REPLACE_EXISTING)!=0;
+#endif
+}
+
+StorageWriter* DirStorage::update(const string& name) {
+  const string fn=file(name), tmp=fn+".tmp";
+  delete_file(tmp.c_str());
+  FP out=fopen(tmp.c_str(), WBPLUS);
+  if (out==FPNULL) return 0;
+  Writer* w=new Writer(out, fn);
+  FP in=fopen(fn.c_str(), RB);
+  if (in!=FPNULL) {  // copy current contents
+    char buf[1<<14];
+    int n;
+    for (int64_t off=0; (n=fread(buf, 1, sizeof(buf), in))>0; off+=n) {
+      if (!w->write(off, buf, n)) {
+        delete w;
+        w=0;
+        break;
+      }
+    }
+    fclose(in);
+  }
+  return w;
+}
+
+void DirStorage::list(const string& prefix, vector<string>& names,
+                      vector<int64_t>& sizes) {
+  const string pdir=prefix.substr(0, prefix.find_last_of("/\\")+1);
+  vector<string> ln;
+  vector<int64_t> ls;
+  listDir(dir, escapeName(objectName(prefix)), ln, ls);
+  for (unsigned i=0; i<ln.size(); ++i) {
+    const string& s=ln[i];
+    if (s.size()>4 && s.substr(s.size()-4)==".tmp") continue;  // staged
+    names.push_back(pdir+unescapeName(s));
+    sizes.push_back(ls[i]);
+  }
+}
+
+// StripeStorage spreads each object over files of the same name
+// (by escapeName() of objectName()) in several directories, normally
+// on different devices. Stripes of UNIT bytes go to each directory in
+// turn, so extract threads reading different blocks use all devices at
+// once. An update writes to each device in its own thread. Each file
+// starts with a header of HDR bytes: "zpaqstrp" count[4] device[4]
+// id[16], where count is the number of devices, device is the index of
+// this one, and id is chosen at random when the object is created.
+// Objects are read or updated only if all the headers agree with dirs.
+class StripeStorage: public Storage {
+public:
+  enum {UNIT=1<<20, HDR=32};  // stripe size, header size
+  vector<string> dirs; // devices, ending with /
+
+  // Return the device holding byte off of an object and set off to
+  // its offset in the file there
+  unsigned place(int64_t& off) const {
+    const int64_t s=off/UNIT, n=dirs.size();
+    off=HDR+s/n*UNIT+off%UNIT;
+    return s%n;
+  }
+
+  // Return the data size of the file on device d of an object of size
+  // len, not counting the header
+  int64_t fileLength(int64_t len, unsigned d) const {
+    const int64_t s=len/UNIT, n=dirs.size();
+    return (s/n+(d<s%n))*UNIT+(d==s%n ? len%UNIT : 0);
+  }
+
+  // Set h[0..HDR-1] to the header of device d of an object with id[16]
+  void header(char* h, const char* id, unsigned d) const {
+    memcpy(h, "zpaqstrp", 8);
+    for (int i=0; i<4; ++i) {
+      h[8+i]=unsigned(dirs.size())>>(i*8);
+      h[12+i]=d>>(i*8);
+    }
+    memcpy(h+16, id, 16);
+  }
+
+  string file(const string& name, unsigned d) const {
+    return dirs[d]+escapeName(objectName(name));
+  }
+  void add(const char* dir) {
+    dirs.push_back(dir);
+    string& d=dirs.back();
+    if (d=="" || (d[d.size()-1]!='/' && d[d.size()-1]!='\\')) d+="/";
+  }
+  int64_t size(const string& name);
+  StorageReader* open(const string& name);
+  StorageWriter* update(const string& name);
+  bool remove(const string& name) {
+    bool r=false;
+    for (unsigned d=0; d<dirs.size(); ++d)
+      r|=delete_file(file(name, d).c_str());
+    return r;
+  }
+  void list(const string& prefix, vector<string>& names,
+            vector<int64_t>& sizes);
+};
+
+// Return the size of object name, or -1 if it is on none of the
+// devices. It is an error if it is missing from some of them, or if a
+// header shows that its file there is from another object or was
+// written with other directories or in another order.
+int64_t StripeStorage::size(const string& name) {
+  int64_t len=0;
+  unsigned found=0;
+  vector<int64_t> fs(dirs.size());
+  char id[16]={0};
+  for (unsigned d=0; d<dirs.size(); ++d) {
+    fs[d]=fileSize(file(name, d));
+    if (fs[d]<0) continue;
+    char h[HDR], e[HDR];
+    FP in=fopen(file(name, d).c_str(), RB);
+    const bool hok=in!=FPNULL && fread(h, 1, HDR, in)==HDR
+        && !memcmp(h, "zpaqstrp", 8);
+    if (in!=FPNULL) fclose(in);
+    if (hok && found==0) memcpy(id, h+16, 16);
+    header(e, id, d);
+    if (!hok || memcmp(h, e, HDR)) {
+      fflush(stdout);
+      printUTF8(name.c_str(), stderr);
+      if (!hok)
+        fprintf(stderr, ": no stripe header in %s\n", dirs[d].c_str());
+      else if (memcmp(h+8, e+8, 8)) {
+        unsigned count=0, dev=0;
+        for (int i=3; i>=0; --i)
+          count=count<<8|(h[8+i]&255), dev=dev<<8|(h[12+i]&255);
+        fprintf(stderr, ": stripe in %s is %u of %u, expected %u of %u\n",
+            dirs[d].c_str(), dev+1, count, d+1, unsigned(dirs.size()));
+      }
+      else
+        fprintf(stderr, ": stripe in %s is from another archive\n",
+            dirs[d].c_str());
+      error("stripes do not match -stripe directories");
+    }
+    ++found;
+    fs[d]-=HDR;
+    len+=fs[d];
+  }
+  if (found==0) return -1;
+  for (unsigned d=0; d<dirs.size(); ++d) {
+    if (fs[d]<0) {
+      fflush(stdout);
+      printUTF8(name.c_str(), stderr);
+      fprintf(stderr, ": stripe missing in %s\n", dirs[d].c_str());
+      error("stripes do not match -stripe directories");
+    }
+    if (fileLength(len, d)!=fs[d]) {
+      fflush(stdout);
+      printUTF8(name.c_str(), stderr);
+      fprintf(stderr, ": stripe in %s has size %1.0f, expected %1.0f\n",
+          dirs[d].c_str(), double(fs[d]), double(fileLength(len, d)));
+      error("stripes are inconsistent");
+    }
+  }
+  return len;
+}
+
+void StripeStorage::list(const string& prefix, vector<string>& names,
+                         vector<int64_t>& sizes) {
+  const string pdir=prefix.substr(0, prefix.find_last_of("/\\")+1);
+  vector<string> ln;
+  vector<int64_t> ls;
+  listDir(dirs[0], escapeName(objectName(prefix)), ln, ls);
+  for (unsigned i=0; i<ln.size(); ++i) {
+    names.push_back(pdir+unescapeName(ln[i]));
+    sizes.push_back(size(names.back()));
+  }
+}
+
+// Read an object from its stripes, opening each device when needed
+class StripeReader: public StorageReader {
+  const StripeStorage& st;
+  const string name;
+  vector<FP> fp;        // by device, or FPNULL if not open
+  vector<int64_t> pos;  // file offsets
+public:
+  StripeReader(const StripeStorage& s, const string& n):
+      st(s), name(n), fp(s.dirs.size(), FPNULL), pos(s.dirs.size()) {}
+  ~StripeReader() {
+    for (unsigned d=0; d<fp.size(); ++d)
+      if (fp[d]!=FPNULL) fclose(fp[d]);
+  }
+  int read(int64_t off, char* buf, int n) {
+    if (n>StripeStorage::UNIT-off%StripeStorage::UNIT)
+      n=StripeStorage::UNIT-off%StripeStorage::UNIT;  // to end of stripe
+    const unsigned d=st.place(off);
+    if (fp[d]==FPNULL) {
+      fp[d]=fopen(st.file(name, d).c_str(), RB);
+      if (fp[d]==FPNULL) return 0;
+      pos[d]=0;
+    }
+    if (off!=pos[d]) fseeko(fp[d], off, SEEK_SET);
+    const int r=fread(buf, 1, n, fp[d]);
+    pos[d]=off+r;
+    return r;
+  }
+};
+
+StorageReader* StripeStorage::open(const string& name) {
+  if (size(name)<0) return 0;
+  return new StripeReader(*this, name);
+}
+
+// One device of a StripeWriter. Its thread writes queued pieces in
+// order. A piece with offset -1 signals synced, and -2 ends the thread.
+struct StripeDevice {
+  FP fp;                 // file on this device
+  int64_t pos;           // file offset after last write
+  bool failed;           // write error
+  Mutex mutex;           // protects q
+  Semaphore work;        // number of pieces in q
+  Semaphore room;        // free slots in q
+  Semaphore synced;      // signaled when q is written
+  std::deque<std::pair<int64_t, string> > q;  // (offset, data) to write
+  ThreadID tid;
+  enum {SLOTS=64};       // most pieces queued
+  StripeDevice(): fp(FPNULL), pos(0), failed(false) {
+    init_mutex(mutex);
+    work.init(0);
+    room.init(SLOTS);
+    synced.init(0);
+  }
+  ~StripeDevice() {
+    destroy_mutex(mutex);
+    work.destroy();
+    room.destroy();
+    synced.destroy();
+  }
+  void put(int64_t off, const char* p, int n) {  // queue a piece
+    room.wait();
+    lock(mutex);
+    q.push_back(std::make_pair(off, string(p, n)));
+    release(mutex);
+    work.signal();
+  }
+};
+
+ThreadReturn stripeThread(void* arg) {
+  StripeDevice& d=*(StripeDevice*)arg;
+  while (true) {
+    d.work.wait();
+    lock(d.mutex);
+    const int64_t off=d.q.front().first;
+    string data;
+    data.swap(d.q.front().second);
+    d.q.pop_front();
+    release(d.mutex);
+    d.room.signal();
+    if (off==-2) break;
+    if (off==-1) {
+      d.synced.signal();
+      continue;
+    }
+    if (off!=d.pos) fseeko(d.fp, off, SEEK_SET);
+    if (fwrite(data.data(), 1, data.size(), d.fp)!=data.size())
+      d.failed=true;
+    d.pos=off+data.size();
+  }
+  return 0;
+}
+
+// Update an object in place on all its devices at once
+class StripeWriter: public StorageWriter {
+  const StripeStorage& st;
+  StripeDevice* dev;  // [st.dirs.size()]
+  int64_t len;        // object size
+  bool running;       // threads started?
+  bool sync();        // wait for queued writes, return true if OK
+  bool stop();        // sync and end threads
+public:
+  StripeWriter(const StripeStorage& s, int64_t n):
+      st(s), dev(new StripeDevice[s.dirs.size()]), len(n), running(false) {}
+  ~StripeWriter() {
+    stop();
+    for (unsigned d=0; d<st.dirs.size(); ++d)
+      if (dev[d].fp!=FPNULL) fclose(dev[d].fp);
+    delete[] dev;
+  }
+  bool open(const string& name, const char* id);
+  int64_t size() {return len;}
+  int read(int64_t off, char* buf, int n);
+  bool write(int64_t off, const char* buf, int n);
+  bool truncate(int64_t n);
+  bool commit();
+};
+
+// Open the files of object name. If id is not 0 then it is new, so
+// write the headers.
+bool StripeWriter::open(const string& name, const char* id) {
+  for (unsigned d=0; d<st.dirs.size(); ++d) {
+    dev[d].fp=fopenUpdate(st.file(name, d));
+    if (dev[d].fp==FPNULL) return false;
+    dev[d].pos=-1;
+    if (id) {
+      char h[StripeStorage::HDR];
+      st.header(h, id, d);
+      if (fwrite(h, 1, sizeof(h), dev[d].fp)!=sizeof(h)) return false;
+    }
+  }
+  for (unsigned d=0; d<st.dirs.size(); ++d)
+    run(dev[d].tid, stripeThread, &dev[d]);
+  running=true;
+  return true;
+}
+
+bool StripeWriter::sync() {
+  if (!running) return false;
+  bool ok=true;
+  for (unsigned d=0; d<st.dirs.size(); ++d) dev[d].put(-1, 0, 0);
+  for (unsigned d=0; d<st.dirs.size(); ++d) {
+    dev[d].synced.wait();
+    if (dev[d].failed) ok=false;
+  }
+  return ok;
+}
+
+bool StripeWriter::stop() {
+  if (!running) return false;
+  const bool ok=sync();
+  for (unsigned d=0; d<st.dirs.size(); ++d) dev[d].put(-2, 0, 0);
+  for (unsigned d=0; d<st.dirs.size(); ++d) join(dev[d].tid);
+  running=false;
+  return ok;
+}
+
+int StripeWriter::read(int64_t off, char* buf, int n) {
+  if (!sync()) return 0;
+  if (n>StripeStorage::UNIT-off%StripeStorage::UNIT)
+    n=StripeStorage::UNIT-off%StripeStorage::UNIT;
+  StripeDevice& d=dev[st.place(off)];
+  fseeko(d.fp, off, SEEK_SET);
+  d.pos=-1;
+  return fread(buf, 1, n, d.fp);
+}
+
+bool StripeWriter::write(int64_t off, const char* buf, int n) {
+  if (!running) return false;
+  if (off+n>len) len=off+n;
+  while (n>0) {  // split at stripe boundaries
+    int k=StripeStorage::UNIT-off%StripeStorage::UNIT;
+    if (k>n) k=n;
+    int64_t foff=off;
+    const unsigned d=st.place(foff);
+    dev[d].put(foff, buf, k);
+    off+=k;
+    buf+=k;
+    n-=k;
+  }
+  return true;
+}
+
+bool StripeWriter::truncate(int64_t n) {
+  if (!sync()) return false;
+  bool ok=true;
+  for (unsigned d=0; d<st.dirs.size(); ++d) {
+    ok&=truncateFile(dev[d].fp, StripeStorage::HDR+st.fileLength(n, d));
+    dev[d].pos=-1;
+  }
+  len=n;
+  return ok;
+}
+
+bool StripeWriter::commit() {
+  bool ok=stop();
+  for (unsigned d=0; d<st.dirs.size(); ++d) {
+    if (fclose(dev[d].fp)) ok=false;
+    dev[d].fp=FPNULL;
+  }
+  return ok;
+}
+
+StorageWriter* StripeStorage::update(const string& name) {
+  const int64_t len=size(name);
+  char id[16];
+  if (len<0) libzpaq::random(id, 16);
+  StripeWriter* w=new StripeWriter(*this, len<0 ? 0 : len);
+  if (!w->open(name, len<0 ? id : 0)) {
+    delete w;
+    return 0;
+  }
+  return w;
+}
+
+LocalStorage localStorage;    // default
+DirStorage dirStorage;        // -storage
+StripeStorage stripeStorage;  // -stripe
+Storage* storage=&localStorage;  // used by InputArchive and OutputArchive
+
+/////////////////////////////// Archive ///////////////////////////////
+
 // Base of InputArchive and OutputArchive
 class ArchiveBase {
 protected:
   libzpaq::AES_CTR* aes;  // NULL if not encrypted
-  FP fp;          // currently open file or FPNULL
 public:
-  ArchiveBase(): aes(0), fp(FPNULL) {}
+  ArchiveBase(): aes(0) {}
   ~ArchiveBase() {
     if (aes) delete aes;
-    if (fp!=FPNULL) fclose(fp);
   }  
-  bool isopen() {return fp!=FPNULL;}
 };
 
 // An InputArchive supports encrypted reading
 class InputArchive: public ArchiveBase, public libzpaq::Reader {
+  vector<string> names;  // part names
   vector<int64_t> sz;  // part sizes
   int64_t off;  // current offset
-  string fn;  // filename, possibly multi-part with wildcards
+  unsigned part;  // part open in in
+  StorageReader* in;  // reader of part or 0 if not found
 public:
 
   // Open filename. If password then decrypt input.
   InputArchive(const char* filename, const char* password=0);
+  ~InputArchive() {delete in;}
+  bool isopen() {return in!=0;}
 
   // Read and return 1 byte or -1 (EOF)
   int get() {
@@ -646,19 +1352,32 @@ public:
   // Read up to len bytes into obuf at current offset. Return 0..len bytes
   // actually read. 0 indicates EOF.
   int read(char* obuf, int len) {
-    int nr=fread(obuf, 1, len, fp);
-    if (nr==0) {
-      seek(0, SEEK_CUR);
-      nr=fread(obuf, 1, len, fp);
+    if (!in) return 0;
+    int64_t p=off;  // offset in part i
+    unsigned i=0;
+    while (i+1<sz.size() && p>=sz[i]) p-=sz[i++];
+    if (i!=part) {
+      delete in;
+      in=storage->open(names[i]);
+      if (!in) ioerr(names[i].c_str());
+      part=i;
     }
-    if (nr==0) return 0;
+    const int nr=in->read(p, obuf, len);
+    if (nr<=0) return 0;
     if (aes) aes->encrypt(obuf, nr, off);
     off+=nr;
     return nr;
   }
 
   // Like fseeko()
-  void seek(int64_t p, int whence);
+  void seek(int64_t p, int whence) {
+    if (whence==SEEK_SET) off=p;
+    else if (whence==SEEK_CUR) off+=p;
+    else if (whence==SEEK_END) {
+      off=p;
+      for (unsigned i=0; i<sz.size(); ++i) off+=sz[i];
+    }
+  }
 
   // Like ftello()
   int64_t tell() {
@@ -666,69 +1385,22 @@ public:
   }
 };
 
-// Like fseeko. If p is out of range then close file.
-void InputArchive::seek(int64_t p, int whence) {
-  if (!isopen()) return;
-
-  // Compute new offset
-  if (whence==SEEK_SET) off=p;
-  else if (whence==SEEK_CUR) off+=p;
-  else if (whence==SEEK_END) {
-    off=p;
-    for (unsigned i=0; i<sz.size(); ++i) off+=sz[i];
-  }
-
-  // Optimization for single file to avoid close and reopen
-  if (sz.size()==1) {
-    fseeko(fp, off, SEEK_SET);
-    return;
-  }
-
-  // Seek across multiple files
-  assert(sz.size()>1);
-  int64_t sum=0;
-  unsigned i;
-  for (i=0;; ++i) {
-    sum+=sz[i];
-    if (sum>off || i+1>=sz.size()) break;
-  }
-  const string next=subpart(fn, i+1);
-  fclose(fp);
-  fp=fopen(next.c_str(), RB);
-  if (fp==FPNULL) ioerr(next.c_str());
-  fseeko(fp, off-sum, SEEK_END);
-}
-
 // Open for input. Decrypt with password and using the salt in the
 // first 32 bytes. If filename has wildcards then assume multi-part
 // and read their concatenation.
 
 InputArchive::InputArchive(const char* filename, const char* password):
-    off(0), fn(filename) {
+    off(0), part(0), in(0) {
   assert(filename);
-
-  // Get file sizes
-  const string part0=subpart(filename, 0);
-  for (unsigned i=1; ; ++i) {
-    const string parti=subpart(filename, i);
-    if (i>1 && parti==part0) break;
-    fp=fopen(parti.c_str(), RB);
-    if (fp==FPNULL) break;
-    fseeko(fp, 0, SEEK_END);
-    sz.push_back(ftello(fp));
-    fclose(fp);
-  }
-
-  // Open first part
-  const string part1=subpart(filename, 1);
-  fp=fopen(part1.c_str(), RB);
-  if (!isopen()) ioerr(part1.c_str());
-  assert(fp!=FPNULL);
+  storage->parts(filename, names, sz);
+  if (names.size()==0) return;
+  in=storage->open(names[0]);
+  if (!in) ioerr(names[0].c_str());
 
   // Get encryption salt
   if (password) {
     char salt[32], key[32];
-    if (fread(salt, 1, 32, fp)!=32) error("cannot read salt");
+    if (in->read(0, salt, 32)!=32) error("cannot read salt");
     libzpaq::stretchKey(key, password, salt);
     aes=new libzpaq::AES_CTR(key, 32, salt);
     off=32;
@@ -737,6 +1409,9 @@ InputArchive::InputArchive(const char* filename, const char* password):
 
 // An Archive is a file supporting encryption
 class OutputArchive: public ArchiveBase, public libzpaq::Writer {
+  string fn;      // name in storage
+  StorageWriter* w;  // open object or 0
+  int64_t pos;    // offset of buf in object
   int64_t off;    // preceding multi-part bytes
   unsigned ptr;   // write pointer in buf: 0 <= ptr <= BUFSIZE
   enum {BUFSIZE=1<<16};
@@ -746,20 +1421,25 @@ public:
   // Open. If password then encrypt output.
   OutputArchive(const char* filename, const char* password=0,
                 const char* salt_=0, int64_t off_=0);
+  ~OutputArchive() {delete w;}  // abandon if not closed
+  bool isopen() {return w!=0;}
 
   // Write pending output
   void flush() {
-    assert(fp!=FPNULL);
-    if (aes) aes->encrypt(buf, ptr, ftello(fp)+off);
-    fwrite(buf, 1, ptr, fp);
+    assert(w);
+    if (aes) aes->encrypt(buf, ptr, pos+off);
+    w->write(pos, buf, ptr);
+    pos+=ptr;
     ptr=0;
   }
 
   // Position the next read or write offset to p.
   void seek(int64_t p, int whence) {
-    if (fp!=FPNULL) {
+    if (w) {
       flush();
-      fseeko(fp, p, whence);
+      if (whence==SEEK_SET) pos=p;
+      else if (whence==SEEK_CUR) pos+=p;
+      else pos=w->size()+p;
     }
     else if (whence==SEEK_SET) off=p;
     else off+=p;  // assume at end
@@ -767,13 +1447,13 @@ public:
 
   // Return current file offset.
   int64_t tell() const {
-    if (fp!=FPNULL) return ftello(fp)+ptr;
+    if (w) return pos+ptr;
     else return off;
   }
 
   // Write one byte
   void put(int c) {
-    if (fp==FPNULL) ++off;
+    if (!w) ++off;
     else {
       if (ptr>=BUFSIZE) flush();
       buf[ptr++]=c;
@@ -782,17 +1462,25 @@ public:
 
   // Write buf[0..n-1]
   void write(const char* ibuf, int len) {
-    if (fp==FPNULL) off+=len;
+    if (!w) off+=len;
     else while (len-->0) put(*ibuf++);
   }
 
-  // Flush output and close
+  // Cut off the output after n bytes. Return true if successful.
+  bool truncate(int64_t n) {
+    if (!w) return false;
+    flush();
+    return w->truncate(n);
+  }
+
+  // Flush output and commit it to storage
   void close() {
-    if (fp!=FPNULL) {
+    if (w) {
       flush();
-      fclose(fp);
+      if (!w->commit()) ioerr(fn.c_str());
+      delete w;
     }
-    fp=FPNULL;
+    w=0;
   }
 };
 
@@ -804,31 +1492,31 @@ public:
 // If off_ is 0 then write salt_ to the first 32 bytes.
 
 OutputArchive::OutputArchive(const char* filename, const char* password,
-    const char* salt_, int64_t off_): off(off_), ptr(0) {
+    const char* salt_, int64_t off_):
+    fn(filename), w(0), pos(0), off(off_), ptr(0) {
   assert(filename);
   if (!*filename) return;
 
   // Open existing file
   char salt[32]={0};
-  fp=fopen(filename, RBPLUS);
-  if (isopen()) {
+  const bool update=storage->size(fn)>=0;
+  w=storage->update(fn);
+  if (!isopen()) ioerr(filename);
+  if (update) {
     if (off!=0) error("file exists and off > 0");
     if (password) {
-      if (fread(salt, 1, 32, fp)!=32) error("cannot read salt");
+      if (w->read(0, salt, 32)!=32) error("cannot read salt");
       if (salt_ && memcmp(salt, salt_, 32)) error("salt mismatch");
     }
     seek(0, SEEK_END);
   }
 
   // Create new file
-  else {
-    fp=fopen(filename, WB);
-    if (!isopen()) ioerr(filename);
-    if (password) {
-      if (!salt_) error("salt not specified");
-      memcpy(salt, salt_, 32);
-      if (off==0 && fwrite(salt, 1, 32, fp)!=32) ioerr(filename);
-    }
+  else if (password) {
+    if (!salt_) error("salt not specified");
+    memcpy(salt, salt_, 32);
+    if (off==0 && !w->write(0, salt, 32)) ioerr(filename);
+    if (off==0) pos=32;
   }
 
   // Set up encryption
@@ -893,16 +1581,226 @@ struct StringWriter: public libzpaq::Writer {
   }
 };
 
-// In Windows convert upper case to lower case.
-inline int tolowerW(int c) {
-#ifndef unix
-  if (c>='A' && c<='Z') return c-'A'+'a';
-#endif
-  return c;
-}
+// Writes the D blocks of an add -concurrent update to a temporary file
+// until they are committed
+struct StageWriter: public libzpaq::Writer {
+  FILE* f;  // or 0 if not used
+  StageWriter(bool on): f(on ? tmpfile() : 0) {if (on && !f) ioerr("tmpfile");}
+  ~StageWriter() {if (f) fclose(f);}
+  void put(int c) {if (putc(c, f)==EOF) ioerr("tmpfile");}
+  void write(const char* buf, int n) {
+    if (fwrite(buf, 1, n, f)!=size_t(n)) ioerr("tmpfile");
+  }
+};
 
-// Return true if strings a == b or a+"/" is a prefix of b
-// or a ends in "/" and is a prefix of b.
+// Makes threads of one process (batch jobs) take ArchiveLocks one at a
+// time, because file locks only exclude other processes
+struct LockMutex {
+  Mutex m;
+  LockMutex() {init_mutex(m);}
+} lockMutex;
+
+// An ArchiveLock is an exclusive lock on the file archive.lock, held by
+// add -concurrent while it reads the archive and while it commits.
+// Constructing it waits for other writers to release it. The system
+// releases it if the process dies, so it is never left stale. If
+// archive is 0 then nothing is locked.
+class ArchiveLock {
+  bool held;
+#ifdef unix
+  int fd;
+#else
+  HANDLE h;
+#endif
+public:
+  ArchiveLock(const char* archive): held(archive!=0) {
+    if (!held) return;
+    const string fn=string(archive)+".lock";
+    lock(lockMutex.m);
+#ifdef unix
+    fd=open(fn.c_str(), O_RDWR|O_CREAT, 0666);
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type=F_WRLCK;
+    fl.l_whence=SEEK_SET;
+    int r=-1;
+    if (fd>=0)
+      while ((r=fcntl(fd, F_SETLKW, &fl))==-1 && errno==EINTR);
+    if (r==-1) {
+      if (fd>=0) close(fd);
+#else
+    h=CreateFile(utow(fn.c_str()).c_str(), GENERIC_READ|GENERIC_WRITE,
+        FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    if (h==INVALID_HANDLE_VALUE
+        || !LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov)) {
+      if (h!=INVALID_HANDLE_VALUE) CloseHandle(h);
+#endif
+      release(lockMutex.m);
+      held=false;
+      ioerr(fn.c_str());
+    }
+  }
+  ~ArchiveLock() {
+    if (!held) return;
+#ifdef unix
+    close(fd);
+#else
+    CloseHandle(h);
+#endif
+    release(lockMutex.m);
+  }
+};
+
+// A HashCache remembers the SHA-1 hash of the contents of local files
+// for -hashcache F, so that a file whose date changed can be compared to
+// the hash stored in the archive without reading it again. A hash is
+// used only while the file keeps the same stamp: size, device, inode and
+// modification time (in Windows, size, volume, file index and write
+// time). F is a list of {hash[20] stamp 0 filename 0}.
+class HashCache {
+  struct Entry {
+    string stamp;
+    char hash[20];
+  };
+  map<string, Entry> m;  // filename -> entry
+  string fn;             // F or "" if off
+  bool changed;          // F needs to be saved
+public:
+  HashCache(): changed(false) {}
+  bool on() const {return fn!="";}
+  void load(const char* filename);  // read F if it exists, turn on
+  void save();                      // write F if changed
+  bool find(const string& filename, char* hash);  // hash[20] if current
+  void put(const string& filename, const string& stamp, const char* hash);
+  static int64_t stamp(const string& filename, string& s);
+};
+
+// Set s to the stamp of filename. Return its modification time in
+// seconds since 1970, or -1 if it does not exist.
+int64_t HashCache::stamp(const string& filename, string& s) {
+#ifdef unix
+  struct stat sb;
+  if (stat(filename.c_str(), &sb)) return -1;
+  s=itos(sb.st_size)+" "+itos(sb.st_dev)+" "+itos(sb.st_ino)+" "
+    +itos(sb.st_mtime);
+  return sb.st_mtime;
+#else
+  HANDLE h=CreateFile(utow(filename.c_str()).c_str(), 0,
+      FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h==INVALID_HANDLE_VALUE) return -1;
+  BY_HANDLE_FILE_INFORMATION fi;
+  const bool ok=GetFileInformationByHandle(h, &fi);
+  CloseHandle(h);
+  if (!ok) return -1;
+  const int64_t mt=fi.ftLastWriteTime.dwLowDateTime
+      +(int64_t(fi.ftLastWriteTime.dwHighDateTime)<<32);  // 100 ns
+  s=itos(fi.nFileSizeLow+(int64_t(fi.nFileSizeHigh)<<32))+" "
+    +itos(fi.dwVolumeSerialNumber)+" "
+    +itos(fi.nFileIndexLow+(int64_t(fi.nFileIndexHigh)<<32))+" "+itos(mt);
+  return mt/10000000-11644473600LL;
+#endif
+}
+
+void HashCache::load(const char* filename) {
+  fn=filename;
+  FP in=fopen(filename, RB);
+  if (in==FPNULL) return;
+  string b;
+  char buf[4096];
+  int n;
+  while ((n=fread(buf, 1, sizeof(buf), in))>0) b.append(buf, n);
+  fclose(in);
+  for (size_t i=0; i+20<b.size();) {
+    Entry e;
+    memcpy(e.hash, b.data()+i, 20);
+    i+=20;
+    const size_t j=b.find('\0', i);
+    if (j==string::npos) break;
+    e.stamp=b.substr(i, j-i);
+    i=j+1;
+    const size_t k=b.find('\0', i);
+    if (k==string::npos) break;
+    m[b.substr(i, k-i)]=e;
+    i=k+1;
+  }
+}
+
+// Write F to F.tmp and rename it, so an interrupted save leaves F as is.
+void HashCache::save() {
+  if (!changed) return;
+  const string tmp=fn+".tmp";
+  FP out=fopen(tmp.c_str(), WB);
+  if (out==FPNULL) {
+    printerr(tmp.c_str());
+    return;
+  }
+  bool ok=true;
+  for (map<string, Entry>::const_iterator p=m.begin(); p!=m.end(); ++p) {
+    string r(p->second.hash, 20);
+    r+=p->second.stamp;
+    r+=char(0);
+    r+=p->first;
+    r+=char(0);
+    if (fwrite(r.data(), 1, r.size(), out)!=r.size()) ok=false;
+  }
+  fclose(out);
+#ifdef unix
+  if (ok) ok=rename(tmp.c_str(), fn.c_str())==0;
+#else
+  if (ok) ok=MoveFileEx(utow(tmp.c_str()).c_str(), utow(fn.c_str()).c_str(),
+                        MOVEFILE_REPLACE_EXISTING)!=0;
+#endif
+  if (!ok) {
+    printerr(fn.c_str());
+    delete_file(tmp.c_str());
+  }
+  changed=false;
+}
+
+// If filename has the same stamp as when its hash was saved then set
+// hash[0..19] and return true. Otherwise forget it and return false.
+bool HashCache::find(const string& filename, char* hash) {
+  map<string, Entry>::iterator p=m.find(filename);
+  if (p==m.end()) return false;
+  string s;
+  if (stamp(filename, s)>=0 && s==p->second.stamp) {
+    memcpy(hash, p->second.hash, 20);
+    return true;
+  }
+  m.erase(p);
+  changed=true;
+  return false;
+}
+
+// Save hash[0..19] of filename read when it had stamp s, if it still
+// does. Skip files modified in the last 2 seconds, because a change in
+// the same second would not change the stamp.
+void HashCache::put(const string& filename, const string& s,
+                    const char* hash) {
+  if (!on()) return;
+  string s2;
+  const int64_t t=stamp(filename, s2);
+  if (t<0 || s2!=s || t>=int64_t(time(NULL))-2) return;
+  Entry& e=m[filename];
+  e.stamp=s;
+  memcpy(e.hash, hash, 20);
+  changed=true;
+}
+
+// In Windows convert upper case to lower case.
+inline int tolowerW(int c) {
+#ifndef unix
+  if (c>='A' && c<='Z') return c-'A'+'a';
+#endif
+  return c;
+}
+
+// Return true if strings a == b or a+"/" is a prefix of b
+// or a ends in "/" and is a prefix of b.
 // Match ? in a to any char in b.
 // Match * in a to any string in b.
 // In Windows, not case sensitive.
@@ -940,6 +1838,11 @@ int64_t btol(const char* &s) {
   return r+(uint64_t(btoi(s))<<32);
 }
 
+// Append n bytes of x to sb in LSB order
+inline void puti(libzpaq::StringBuffer& sb, uint64_t x, int n) {
+  for (; n>0; --n) sb.put(x&255), x>>=8;
+}
+
 /////////////////////////////// Jidac /////////////////////////////////
 
 // A Jidac object represents an archive contents: a list of file
@@ -968,7 +1871,8 @@ struct DT {
   int64_t attr;          // first 8 attribute bytes
   int64_t data;          // sort key or frags written. -1 = do not write
   vector<unsigned> ptr;  // fragment list
-  DT(): date(0), size(0), attr(0), data(0) {}
+  char hash[21];         // 1 and SHA-1 of contents, or 0 if not known
+  DT(): date(0), size(0), attr(0), data(0) {hash[0]=0;}
 };
 typedef map<string, DT> DTMap;
 
@@ -987,6 +1891,58 @@ struct Block {
       size(0), frags(0), extracted(0), state(READY) {}
 };
 
+// Cumulative offsets of the fragments of a file for random access.
+// Fragment ptr[i] holds file offsets off[i]..off[i+1]-1, so the
+// fragment containing any offset is found by binary search.
+struct SeekTable {
+  vector<int64_t> off;   // ptr.size()+1 offsets, empty if a size is unknown
+  SeekTable(const vector<unsigned>& ptr, const vector<HT>& ht);
+  unsigned find(int64_t pos) const {  // index in ptr of pos, or ptr.size()
+    return std::upper_bound(off.begin(), off.end(), pos)-off.begin()-1;
+  }
+};
+
+SeekTable::SeekTable(const vector<unsigned>& ptr, const vector<HT>& ht) {
+  off.resize(ptr.size()+1);
+  off[0]=0;
+  for (unsigned i=0; i<ptr.size(); ++i) {
+    if (ptr[i]<1 || ptr[i]>=ht.size() || ht[ptr[i]].usize<0) {
+      off.clear();
+      return;
+    }
+    off[i+1]=off[i]+ht[ptr[i]].usize;
+  }
+}
+
+// A sorted run of external files saved to a temporary file by
+// Jidac::spill(), read back one record at a time in filename order
+struct Run {
+  FILE* f;               // open temporary file or NULL after last record
+  string filename;       // current record
+  DT d;                  // date, size, attr of current record
+  Run(FILE* fp=0): f(fp) {}
+  bool next();           // read next record or close f and return false
+};
+
+// A tar archive read in order by add -tar from a file or stdin.
+// next() skips the rest of the current member and reads the next
+// header, applying any pax or GNU long name headers before it.
+struct TarReader {
+  FP f;                  // input or FPNULL if not -tar
+  int64_t skip;          // bytes to skip to the next header
+  string name;           // member name, directories end with /
+  string link;           // hard link target
+  char type;             // '0' = file, '1' = hard link, '5' = directory
+  int64_t size;          // size of member data
+  int64_t mtime;         // seconds since 1970
+  int64_t mode;          // permissions
+  const char* err;       // why input ended early, or 0
+  TarReader(): f(FPNULL), skip(0), type(0), size(0), mtime(0), mode(0),
+      err(0) {}
+  bool next();           // read next header or return false at end
+  bool read(char* p, int64_t n);  // read exactly n bytes to p (or 0)
+};
+
 // Version info
 struct VER {
   int64_t date;          // Date of C block, 0 if streaming
@@ -1009,32 +1965,83 @@ typedef BOOL (WINAPI* FindNextStreamW_t)(HANDLE, LPVOID);
 FindNextStreamW_t findNextStreamW=0;
 #endif
 
+// Compression resources shared by the jobs of a batch command. cpu
+// limits the blocks compressed at once by all jobs to -threads, and mem
+// limits the blocks queued to compress or write to -memory.
+struct BatchPool {
+  Semaphore cpu;         // compressors available to any job
+  Semaphore mem;         // MB of blocks that may be held
+  Mutex memlock;         // so a block takes all of its MB at once
+  int threads;           // default -threads of each job
+  int memsize;           // -memory in MB, 0 = no limit
+  BatchPool(int t, int mb): threads(t), memsize(mb) {
+    cpu.init(t);
+    mem.init(mb);
+    init_mutex(memlock);
+  }
+  ~BatchPool() {
+    destroy_mutex(memlock);
+    mem.destroy();
+    cpu.destroy();
+  }
+  int take(int64_t n);   // wait for MB to hold n bytes, return MB taken
+  void give(int mb) {for (int i=0; i<mb; ++i) mem.signal();}
+};
+
+int BatchPool::take(int64_t n) {
+  if (memsize<1) return 0;
+  const int mb=int(min(int64_t(memsize), n/1000000+1));
+  lock(memlock);
+  for (int i=0; i<mb; ++i) mem.wait();
+  release(memlock);
+  return mb;
+}
+
 class CompressJob;
 
 // Do everything
 class Jidac {
 public:
+  Jidac(): pool(0) {}
   int doCommand(int argc, const char** argv);
+  BatchPool* pool;          // shared with other jobs of a batch, else 0
   friend ThreadReturn decompressThread(void* arg);
   friend ThreadReturn testThread(void* arg);
   friend struct ExtractJob;
+  friend ThreadReturn grepThread(void* arg);
+  friend ThreadReturn streamThread(void* arg);
+  friend ThreadReturn stdoutThread(void* arg);
+  friend ThreadReturn locateThread(void* arg);
+  friend ThreadReturn salvageThread(void* arg);
 private:
 
   // Command line arguments
-  char command;             // command 'a', 'x', or 'l'
+  char command;             // command 'a', 'x', 'l', 'g', 'e', 's', 'b', 'o'
   string archive;           // archive name
+  const char* cache;        // -cache segment table of streaming archive
+  bool concurrent;          // -concurrent: add with other writers
+  string pattern;           // string to search for with grep
   vector<string> files;     // filename args
   int all;                  // -all option
   bool force;               // -force option
   int fragment;             // -fragment option
+  int64_t fragmin;          // -fragment file size to use larger, 0 = off
+  HashCache hashcache;      // -hashcache hashes of local files
+  unsigned fixed;           // -fixed fragment size in bytes, 0 = off
+  int64_t fixedmin;         // -fixed minimum file size, 0 = none
+  vector<string> fixedfiles;// -fixed files to split at fixed offsets
   const char* index;        // index option
+  int64_t memory;           // -memory option in bytes, 0 = no limit
   char password_string[32]; // hash of -key argument
   const char* password;     // points to password_string or NULL
   string method;            // default "1"
+  double sample;            // estimate: percent of input to read
   bool noattributes;        // -noattributes option
   vector<string> notfiles;  // list of prefixes to exclude
   string nottype;           // -not =...
   vector<string> onlyfiles; // list of prefixes to include
+  int64_t rangestart;       // -range offset to extract, -1 = whole files
+  int64_t rangesize;        // -range length, -1 = to end of file
   const char* repack;       // -repack output file
   char new_password_string[32]; // -repack hashed password
   const char* new_password; // points to new_password_string or NULL
@@ -1042,6 +2049,12 @@ private:
   bool dotest;              // -test option
   int threads;              // default is number of cores
   vector<string> tofiles;   // -to option
+  FP dataout;               // -stdout or -tar output, else FPNULL
+  bool tar;                 // -tar option
+  const char* tarfile;      // -tar file or NULL for stdout or stdin
+  TarReader tarin;          // add -tar input
+  map<string, vector<unsigned> > tarptr;  // add -tar: files added
+  bool verify;              // -verify option
   int64_t date;             // now as decimal YYYYMMDDHHMMSS (UT)
   int64_t version;          // version number or 14 digit date
 
@@ -1053,23 +2066,49 @@ private:
   DTMap edt;                // set of external files to add or compare
   vector<Block> block;      // list of data blocks to extract
   vector<VER> ver;          // version info
+  int64_t edtmem;           // estimated memory used by edt
+  vector<Run> runs;         // edt spilled to sorted runs with -memory
+  int64_t run_size;         // total size of files to add in runs
+  unsigned run_files;       // number of files to add in runs
+  map<string, int64_t> rangeskip;  // -range: bytes to skip in trimmed ptr
 
   // Commands
-  int add();                // add, return 1 if error else 0
+  int add();                // add or estimate, return 1 if error else 0
   int extract();            // extract, return 1 if error else 0
+  int extractStdout();      // extract -stdout, return 1 if error else 0
   int list();               // list, return 0
+  int grep();               // search, return 1 if error else 0
+  int salvage();            // recover, return 1 if damaged else 0
+  int compile();            // write C++ for -method, return 0
+  int batch();              // run add jobs, return 1 if any failed else 0
   void usage();             // help
 
   // Support functions
   string rename(string name);           // rename from -to
   int64_t read_archive(const char* arc, int *errors=0);  // read arc
+  void addSegment(string fn, bool named, const char* sha1result,
+                  bool newblock, int64_t offset, unsigned& files);
   bool isselected(const char* filename, bool rn=false);// files, -only, -not
   void scandir(string filename);        // scan dirs to dt
   void addfile(string filename, int64_t edate, int64_t esize,
                int64_t eattr);          // add external file to dt
+  bool isadded(DTMap::iterator p, DTMap::iterator a);  // compress p?
+  void spill();                         // save edt to a run and clear
+  void mergeRuns();                     // merge runs into one, count
+  bool nextBatch();                     // refill edt from runs
+  bool nextTar();                       // refill edt from tarin
+  int64_t sortFiles(vector<DTMap::iterator>& vf);  // files to compress
+  unsigned fixedSize(DTMap::iterator p);  // -fixed fragment size for p
+  int fileFragment(int64_t size);       // -fragment for file of size
+  int64_t trimRange(DTMap::iterator p);   // -range: keep needed frags
+  unsigned findBlock(unsigned frag);    // index in block of frag
+  bool writeOut(const char* s, size_t n);  // to dataout unless -test
+  void sampleRanges(int64_t n, vector<int64_t>& r);  // estimate: parts
+  void indexFiles(StringBuffer& ib, int& added);  // I block contents
   void list_versions(int64_t csize);    // print ver. csize=archive size
   bool equal(DTMap::const_iterator p, const char* filename);
              // compare file contents with p
+  bool hashFile(const string& filename, char* hash);  // SHA-1 of file
 };
 
 // Print help message
@@ -1082,34 +2121,61 @@ void Jidac::usage() {
 "   a  add         Append files to archive if dates have changed.\n"
 "   x  extract     Extract most recent versions of files.\n"
 "   l  list        List or compare external files to archive by dates.\n"
+"   g  grep        Search archive files for a string: g archive string...\n"
+"   e  estimate    Estimate size and time to add files by sampling.\n"
+"   s  salvage     Recover damaged archive to new archive: s archive out\n"
+"   b  batch       Run add jobs listed in a file, one per line: b file\n"
+"      compile     Write C++ for -method x... to link in: compile file.cpp\n"
 "Options:\n"
 "  -all [N]        Extract/list versions in N [4] digit directories.\n"
+"  -cache F        Save streaming archive segment list in F to read faster.\n"
+"  -concurrent     Add: stage update, commit while other writers add too.\n"
 "  -f -force       Add: append files if contents have changed.\n"
 "                  Extract: overwrite existing output files.\n"
 "                  List: compare file contents instead of dates.\n"
+"  -fixed N [M] [files...]  Add: split files or files of M+ MB (default\n"
+"                  all) into N KiB fragments at fixed offsets.\n"
+"  -hashcache F    Add: store file hashes, keep local copies in F, and\n"
+"                  skip files with new dates if contents are unchanged.\n"
+"                  Extract/list -force: compare by hash from F if able.\n"
 "  -index F        Extract: create index F for archive.\n"
 "                  Add: create suffix for archive indexed by F, update F.\n"
 "  -key X          Create or access encrypted archive with password X.\n"
+"  -memory N[kmg]  Add: limit file lists to N MB, sort on disk.\n"
+"                  Extract -stdout: limit blocks held to reorder output.\n"
+"                  Batch: limit blocks held by all jobs.\n"
 "  -mN  -method N  Compress level N (0..5 = faster..better, default 1).\n"
 "  -noattributes   Ignore/don't save file attributes or permissions.\n"
 "  -not files...   Exclude. * and ? match any string or char.\n"
 "       =[+-#^?]   List: exclude by comparison result.\n"
 "  -only files...  Include only matches (default: *).\n"
+"  -range N [M]    Extract M bytes (default: rest) at offset N of files.\n"
 "  -repack F [X]   Extract to new archive F with key X (default: none).\n"
+"  -sample N       Estimate: read N%% of input (default 10).\n"
 "  -sN -summary N  List: show top N sorted by size. -1: show frag IDs.\n"
 "                  Add/Extract: if N > 0 show brief progress.\n"
+"  -stdout         Extract: write files in name order to standard output.\n"
+"  -storage D      Keep archives as objects in directory D, as a stand-in\n"
+"                  for object storage (for testing).\n"
+"  -stripe dirs... Spread archives over dirs in 1 MiB stripes.\n"
+"  -tar [F]        Extract: write a tar archive to F or standard output.\n"
+"                  Add: add the contents of tar F or standard input.\n"
 "  -test           Extract: verify but do not write files.\n"
 "  -tN -threads N  Use N threads (default: 0 = %d cores).\n"
 "  -to out...      Rename files... to out... or all to out/all.\n"
 "  -until N        Roll back archive to N'th update or -N from end.\n"
 "  -until %s  Set date, roll back (UT, default time: 235959).\n"
+"  -verify         Add: decompress and check written blocks before commit.\n"
 #ifndef NDEBUG
 "Advanced options:\n"
-"  -fragment N     Use 2^N KiB average fragment size (default: 6).\n"
+"  -fragment N [M] Use 2^N KiB average fragment size (default: 6), doubled\n"
+"                  per factor of 4 that a file is over M MB (default: off).\n"
 "  -mNB -method NB Use 2^B MiB blocks (0..11, default: 04, 14, 26..56).\n"
 "  -method {xs}B[,N2]...[{ciawmst}[N1[,N2]...]]...  Advanced:\n"
 "  x=journaling (default). s=streaming (no dedupe).\n"
 "    N2: 0=no pre/post. 1,2=packed,byte LZ77. 3=BWT. 4..7=0..3 with E8E9.\n"
+"    8=transpose N3 byte records into columns, with delta coding if N4=1.\n"
+"    9=replace frequent words with byte codes and capitals with a prefix.\n"
 "    N3=LZ77 min match. N4=longer match to try first (0=none). 2^N5=search\n"
 "    depth. 2^N6=hash table size (N6=B+21: suffix array). N7=lookahead.\n"
 "    Context modeling defaults shown below:\n"
@@ -1168,26 +2234,56 @@ int Jidac::doCommand(int argc, const char** argv) {
   command=0;
   force=false;
   fragment=6;
+  fragmin=0;  // off
+  fixed=0;
+  fixedmin=0;
   all=0;
   password=0;  // no password
   index=0;
+  cache=0;
+  concurrent=false;
+  memory=0;  // no limit
   method="";  // 0..5
+  rangestart=rangesize=-1;  // whole files
+  sample=10;  // percent
   noattributes=false;
   repack=0;
   new_password=0;
   summary=0; // detailed: -1
   dotest=false;  // -test
   threads=0; // 0 = auto-detect
+  verify=false;  // -verify
   version=DEFAULT_VERSION;
   date=0;
+  dataout=FPNULL;
+  tar=false;
+  tarfile=0;
+
+  // With -stdout or extract -tar to stdout, messages go to stderr
+  bool toadd=false;  // command is add or estimate?
+  for (int i=1; i<argc; ++i) {
+    const string opt=argv[i];
+    if (opt=="add" || opt=="a" || opt=="estimate" || opt=="e") {
+      toadd=true;
+      break;
+    }
+    if (opt=="extract" || opt=="x" || opt=="list" || opt=="l") break;
+  }
+  for (int i=1; i<argc && !pool; ++i)
+    if ((!strcmp(argv[i], "-stdout") || (!strcmp(argv[i], "-tar") && !toadd
+        && (i+1==argc || argv[i+1][0]=='-'))) && dataout==FPNULL)
+      dataout=stdoutData();
 
-  printf("zpaq v" ZPAQ_VERSION " journaling archiver, compiled "
-         __DATE__ "\n");
+  if (!pool)
+    printf("zpaq v" ZPAQ_VERSION " journaling archiver, compiled "
+           __DATE__ "\n");
 
   // Init archive state
   ht.resize(1);  // element 0 not used
   ver.resize(1); // version 0
   dhsize=dcsize=0;
+  edtmem=run_size=0;
+  run_files=0;
 
   // Get date
   time_t now=time(NULL);
@@ -1199,14 +2295,23 @@ int Jidac::doCommand(int argc, const char** argv) {
   for (int i=1; i<argc; ++i) {
     const string opt=argv[i];  // read command
     if ((opt=="add" || opt=="extract" || opt=="list" || opt=="convert"
-         || opt=="a" || opt=="x" || opt=="l" || opt=="c")
+         || opt=="grep" || opt=="estimate" || opt=="salvage"
+         || opt=="compile" || opt=="batch" || opt=="b"
+         || opt=="a" || opt=="x" || opt=="l" || opt=="c" || opt=="g"
+         || opt=="e" || opt=="s")
         && i<argc-1 && argv[i+1][0]!='-' && command==0) {
       command=opt[0];
       if (opt=="extract") command='x';
+      if (opt=="compile") command='o';
       archive=argv[++i];  // append ".zpaq" to archive if no extension
       const char* slash=strrchr(argv[i], '/');
       const char* dot=strrchr(slash ? slash : argv[i], '.');
-      if (!dot && archive!="") archive+=".zpaq";
+      if (!dot && archive!="" && command!='b')
+        archive+=command=='o' ? ".cpp" : ".zpaq";
+      if (command=='g') {  // read pattern
+        if (i+1>=argc) usage();
+        pattern=argv[++i];
+      }
       while (++i<argc && argv[i][0]!='-')  // read filename args
         files.push_back(argv[i]);
       --i;
@@ -1216,8 +2321,25 @@ int Jidac::doCommand(int argc, const char** argv) {
       all=4;
       if (i<argc-1 && isdigit(argv[i+1][0])) all=atoi(argv[++i]);
     }
+    else if (opt=="-cache" && i<argc-1) cache=argv[++i];
+    else if (opt=="-concurrent") concurrent=true;
     else if (opt=="-force" || opt=="-f") force=true;
-    else if (opt=="-fragment" && i<argc-1) fragment=atoi(argv[++i]);
+    else if (opt=="-fragment" && i<argc-1) {  // read N [M]
+      fragment=atoi(argv[++i]);
+      if (i<argc-1 && isdigit(argv[i+1][0]))
+        fragmin=atol(argv[++i])*1000000LL;  // MB
+    }
+    else if (opt=="-hashcache" && i<argc-1) hashcache.load(argv[++i]);
+    else if (opt=="-fixed" && i<argc-1) {  // read size and fixedfiles
+      fixed=atoi(argv[++i])*1024;
+      while (++i<argc && argv[i][0]!='-') {
+        const char* p=argv[i];
+        while (isdigit(*p)) ++p;
+        if (*p) fixedfiles.push_back(argv[i]);
+        else fixedmin=atol(argv[i])*1000000LL;  // MB
+      }
+      --i;
+    }
     else if (opt=="-index" && i<argc-1) index=argv[++i];
     else if (opt=="-key" && i<argc-1) {
       libzpaq::SHA256 sha256;
@@ -1225,6 +2347,14 @@ int Jidac::doCommand(int argc, const char** argv) {
       memcpy(password_string, sha256.result(), 32);
       password=password_string;
     }
+    else if (opt=="-memory" && i<argc-1) {  // MB or with suffix k, m, g
+      char* end=0;
+      double m=strtod(argv[++i], &end);
+      if (end && (*end=='k' || *end=='K')) m/=1000;
+      if (end && (*end=='g' || *end=='G')) m*=1000;
+      memory=int64_t(m*1000000);
+      if (memory<0) usage();
+    }
     else if (opt=="-method" && i<argc-1) method=argv[++i];
     else if (opt[1]=='m') method=argv[i]+2;
     else if (opt=="-noattributes") noattributes=true;
@@ -1240,6 +2370,11 @@ int Jidac::doCommand(int argc, const char** argv) {
         onlyfiles.push_back(argv[i]);
       --i;
     }
+    else if (opt=="-range" && i<argc-1 && isdigit(argv[i+1][0])) {
+      rangestart=int64_t(atof(argv[++i]));
+      if (i<argc-1 && isdigit(argv[i+1][0]))
+        rangesize=int64_t(atof(argv[++i]));
+    }
     else if (opt=="-repack" && i<argc-1) {
       repack=argv[++i];
       if (i<argc-1 && argv[i+1][0]!='-') {
@@ -1249,8 +2384,28 @@ int Jidac::doCommand(int argc, const char** argv) {
         new_password=new_password_string;
       }
     }
+    else if (opt=="-sample" && i<argc-1) {
+      sample=atof(argv[++i]);
+      if (sample<=0 || sample>100) usage();
+    }
+    else if (opt=="-stdout") assert(dataout!=FPNULL);
+    else if (opt=="-storage" && i<argc-1) {
+      dirStorage.setdir(argv[++i]);
+      storage=&dirStorage;
+    }
+    else if (opt=="-stripe") {  // read directories
+      while (++i<argc && argv[i][0]!='-')
+        stripeStorage.add(argv[i]);
+      --i;
+      if (stripeStorage.dirs.size()==0) usage();
+      storage=&stripeStorage;
+    }
     else if (opt=="-summary" && i<argc-1) summary=atoi(argv[++i]);
     else if (opt[1]=='s') summary=atoi(argv[i]+2);
+    else if (opt=="-tar") {
+      tar=true;
+      if (i<argc-1 && argv[i+1][0]!='-') tarfile=argv[++i];
+    }
     else if (opt=="-test") dotest=true;
     else if (opt=="-to") {  // read tofiles
       while (++i<argc && argv[i][0]!='-')
@@ -1305,6 +2460,7 @@ int Jidac::doCommand(int argc, const char** argv) {
         date=version;
       }
     }
+    else if (opt=="-verify") verify=true;
     else {
       printf("Unknown option ignored: %s\n", argv[i]);
       usage();
@@ -1312,7 +2468,7 @@ int Jidac::doCommand(int argc, const char** argv) {
   }
 
   // Set threads
-  if (threads<1) threads=numberOfProcessors();
+  if (threads<1) threads=pool ? pool->threads : numberOfProcessors();
 
   // Test date
   if (now==-1 || date<19000000000000LL || date>30000000000000LL)
@@ -1342,11 +2498,18 @@ int Jidac::doCommand(int argc, const char** argv) {
 #endif
 
   // Execute command
-  if (command=='a' && files.size()>0) return add();
-  else if (command=='x') return extract();
+  int result=0;
+  if ((command=='a' || command=='e') && (files.size()>0 || tar))
+    result=add();
+  else if (command=='x') result=extract();
   else if (command=='l') list();
+  else if (command=='g') result=grep();
+  else if (command=='s' && files.size()==1) result=salvage();
+  else if (command=='o') result=compile();
+  else if (command=='b' && files.size()==0) result=batch();
   else usage();
-  return 0;
+  hashcache.save();
+  return result;
 }
 
 /////////////////////////// read_archive //////////////////////////////
@@ -1395,6 +2558,68 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
   StringBuffer os(32832);  // decompressed block
   const bool renamed=command=='l' || command=='a';
 
+  // With -cache, read the segments of a streaming archive saved by an
+  // earlier scan and resume scanning where it ended. The table is
+  // "ZPSG", end offset[8], SHA-1 of up to 4096 bytes before end[20],
+  // then for each segment: flags[1] (1=new block, 2=named),
+  // [offset[8] if new block], [name length[2], name if named], sha1[21].
+  // It is ignored if the archive no longer matches.
+  StringBuffer segtab;  // segment records
+  if (cache && password) error("-cache does not support encryption");
+  if (cache && version>=1) {
+    FP fp=fopen(cache, RB);
+    if (fp!=FPNULL) {
+      char hdr[32], buf[4096];
+      int64_t end=0;
+      if (fread(hdr, 1, 32, fp)==32 && memcmp(hdr, "ZPSG", 4)==0) {
+        const char* p=hdr+4;
+        end=btol(p);
+        const int n=end<4096 ? end : 4096;
+        libzpaq::SHA1 sha1;
+        in.seek(end-n, SEEK_SET);
+        if (end>0 && in.read(buf, n)==n) sha1.write(buf, n);
+        if (sha1.usize()==0 || memcmp(sha1.result(), hdr+12, 20)) end=0;
+      }
+      for (int r; end>0 && (r=fread(buf, 1, 4096, fp))>0;)
+        segtab.write(buf, r);
+      fclose(fp);
+      in.seek(32*(password!=0), SEEK_SET);
+      for (int pass=0; end>0 && pass<2; ++pass) {  // check, then replay
+        const char* p=segtab.c_str();
+        const char* const e=p+segtab.size();
+        while (p<e) {
+          const int flags=*p++;
+          if (flags&~3) break;
+          int64_t off=block_offset;
+          if ((flags&1) && p+8<=e) off=btol(p);
+          else if (flags&1) break;
+          if ((flags&2) && p+2<=e) {
+            const unsigned len=(p[0]&255)+(p[1]&255)*256;
+            p+=2;
+            if (p+len>e) break;
+            if (pass) lastfile=string(p, len);
+            p+=len;
+          }
+          else if (flags&2) break;
+          if (p+21>e) break;
+          if (pass) {
+            addSegment(lastfile, (flags&2) || first, p, flags&1, off, files);
+            first=false;
+            block_offset=off;
+          }
+          p+=21;
+        }
+        if (p!=e) end=0;  // corrupted
+      }
+      if (end>0) {
+        found_data=true;
+        block_offset=end;
+        in.seek(end, SEEK_SET);
+      }
+      else segtab.reset();
+    }
+  }
+
   // Detect archive format and read the filenames, fragment sizes,
   // and hashes. In JIDAC format, these are in the index blocks, allowing
   // data to be skipped. Otherwise the whole archive is scanned to get
@@ -1565,6 +2790,10 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
                   if (s+4>end) error("missing attr");
                   unsigned na=btoi(s);  // attr bytes
                   if (s+na>end || na>65535) error("attr too long");
+                  if (na>=28) {  // attr[8] hash[20]
+                    dtr.hash[0]=1;
+                    memcpy(dtr.hash+1, s+8, 20);
+                  }
                   for (unsigned i=0; i<na; ++i, ++s)  // read attr
                     if (i<8) dtr.attr+=int64_t(*s&255)<<(i*8);
                   if (noattributes) dtr.attr=0;
@@ -1590,39 +2819,26 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
           // Streaming format
           else {
 
-            // If previous version does not exist, start a new one
-            if (ver.size()==1) {
-              if (version<1) {
-                done=true;
-                goto endblock;
-              }
-              ver.push_back(VER());
-              ver.back().firstFragment=ht.size();
-              ver.back().offset=block_offset;
-              ver.back().csize=-1;
+            // Stop if rolled back to before the first version
+            if (ver.size()==1 && version<1) {
+              done=true;
+              goto endblock;
             }
 
             char sha1result[21]={0};
             d.readSegmentEnd(sha1result);
             skip=true;
-            string fn=lastfile;
-            if (all) fn=append_path(itos(ver.size()-1, all), fn);
-            if (isselected(fn.c_str(), renamed)) {
-              DT& dtr=dt[fn];
-              if (filename.s.size()>0 || first) {
-                ++files;
-                dtr.date=date;
-                dtr.attr=0;
-                dtr.ptr.resize(0);
-                ++ver.back().updates;
+            addSegment(lastfile, filename.s.size()>0 || first, sha1result,
+                       segs==0, block_offset, files);
+            if (cache) {  // save for -cache
+              segtab.put((segs==0)+2*(filename.s.size()>0));
+              if (segs==0) puti(segtab, block_offset, 8);
+              if (filename.s.size()>0) {
+                puti(segtab, lastfile.size(), 2);
+                segtab.write(lastfile.c_str(), lastfile.size());
               }
-              dtr.ptr.push_back(ht.size());
+              segtab.write(sha1result, 21);
             }
-            assert(ver.size()>0);
-            if (segs==0 || block.size()==0)
-              block.push_back(Block(ht.size(), block_offset));
-            assert(block.size()>0);
-            ht.push_back(HT(sha1result+1, -1));
           }  // end else streaming
           ++segs;
           filename.s="";
@@ -1638,11 +2854,35 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
       fprintf(stderr, "Skipping block at %1.0f: %s\n", double(block_offset),
               e.what());
       if (errors) ++*errors;
+      segtab.reset();
+      cache=0;  // don't save
     }
 endblock:;
   }  // end while !done
   if (in.tell()>32*(password!=0) && !found_data)
     error("archive contains no data");
+
+  // Save -cache if the archive is all streaming
+  if (cache && block_offset>0 && ver.size()==2 && ver[1].csize==-1) {
+    char buf[4096];
+    const int n=block_offset<4096 ? block_offset : 4096;
+    in.seek(block_offset-n, SEEK_SET);
+    libzpaq::SHA1 sha1;
+    if (in.read(buf, n)==n) {
+      sha1.write(buf, n);
+      StringBuffer hdr;
+      hdr.write("ZPSG", 4);
+      puti(hdr, block_offset, 8);
+      hdr.write(sha1.result(), 20);
+      FP fp=fopen(cache, WB);
+      if (fp==FPNULL) printerr(cache);
+      else {
+        fwrite(hdr.c_str(), 1, hdr.size(), fp);
+        fwrite(segtab.c_str(), 1, segtab.size(), fp);
+        fclose(fp);
+      }
+    }
+  }
   printf("%d versions, %u files, %u fragments, %1.6f MB\n", 
       int(ver.size()-1), files, unsigned(ht.size())-1,
       block_offset/1000000.0);
@@ -1660,6 +2900,37 @@ endblock:;
   return block_offset;
 }
 
+// Add a segment of a streaming archive to ver, dt, block, and ht. fn is
+// the file it belongs to, named is true if it starts the file, and
+// sha1result is 0 or 1 followed by its hash. If newblock then the segment
+// starts a block at offset. Count files added.
+void Jidac::addSegment(string fn, bool named, const char* sha1result,
+                       bool newblock, int64_t offset, unsigned& files) {
+
+  // If previous version does not exist, start a new one
+  if (ver.size()==1) {
+    ver.push_back(VER());
+    ver.back().firstFragment=ht.size();
+    ver.back().offset=offset;
+    ver.back().csize=-1;
+  }
+  if (all) fn=append_path(itos(ver.size()-1, all), fn);
+  if (isselected(fn.c_str(), command=='l' || command=='a')) {
+    DT& dtr=dt[fn];
+    if (named) {
+      ++files;
+      dtr.date=date;
+      dtr.attr=0;
+      dtr.ptr.resize(0);
+      ++ver.back().updates;
+    }
+    dtr.ptr.push_back(ht.size());
+  }
+  if (newblock || block.size()==0)
+    block.push_back(Block(ht.size(), offset));
+  ht.push_back(HT(sha1result+1, -1));
+}
+
 // Test whether filename and attributes are selected by files, -only, and -not
 // If rn then test renamed filename.
 bool Jidac::isselected(const char* filename, bool rn) {
@@ -1808,15 +3079,12 @@ void Jidac::addfile(string filename, int64_t edate,
   d.size=esize;
   d.attr=noattributes?0:eattr;
   d.data=0;
+  edtmem+=sizeof(DT)+filename.size()+80;
+  if (memory>0 && command=='a' && edtmem>memory/2) spill();
 }
 
 //////////////////////////////// add //////////////////////////////////
 
-// Append n bytes of x to sb in LSB order
-inline void puti(libzpaq::StringBuffer& sb, uint64_t x, int n) {
-  for (; n>0; --n) sb.put(x&255), x>>=8;
-}
-
 // Print percent done (td/ts) and estimated time remaining
 void print_progress(int64_t ts, int64_t td, int sum) {
   if (td>ts) td=ts;
@@ -1833,7 +3101,9 @@ void print_progress(int64_t ts, int64_t td, int sum) {
 // COMPRESSED, WRITING. The main thread waits for EMPTY buffers and
 // fills them. A set of compressThreads waits for FULL threads and compresses
 // them. A writeThread waits for COMPRESSED buffers at the front
-// of the queue and writes and removes them.
+// of the queue and writes and removes them. With -verify, the writeThread
+// passes a copy of each written block to a set of verifyThreads, which
+// decompress it and compare SHA-1 hashes while writing continues.
 
 // Buffer queue element
 struct CJ {
@@ -1843,9 +3113,18 @@ struct CJ {
   string filename;       // to write in filename field
   string comment;        // if "" use default
   string method;         // compression level or "" to mark end of data
+  string sha1s;          // fragment hashes of a D block to verify
   Semaphore full;        // 1 if in is FULL of data ready to compress
   Semaphore compressed;  // 1 if out contains COMPRESSED data
-  CJ(): state(EMPTY) {}
+  int mb;                // taken from BatchPool for in and out
+  CJ(): state(EMPTY), mb(0) {}
+};
+
+// A written block waiting to be verified
+struct VJ {
+  StringBuffer out;      // compressed block as written
+  string filename;       // for error messages
+  string sha1s;          // expected fragment hashes or ""
 };
 
 // Instructions to a compression job
@@ -1860,16 +3139,26 @@ private:
   libzpaq::Writer* out;  // archive
   Semaphore empty;       // number of empty buffers ready to fill
   Semaphore compressors; // number of compressors available to run
+  int verifiers;         // number of verifyThreads, 0 = no -verify
+  std::deque<VJ*> vq;    // written blocks to verify, NULL = end
+  Semaphore vready;      // number of elements in vq
+  Semaphore vslots;      // number of blocks that may be added to vq
+  BatchPool* pool;       // shared with other jobs of a batch, or 0
 public:
   friend ThreadReturn compressThread(void* arg);
   friend ThreadReturn writeThread(void* arg);
-  CompressJob(int threads, int buffers, libzpaq::Writer* f):
-      job(0), q(0), qsize(buffers), front(0), out(f) {
+  friend ThreadReturn verifyThread(void* arg);
+  CompressJob(int threads, int buffers, libzpaq::Writer* f, int v=0,
+              BatchPool* bp=0):
+      job(0), q(0), qsize(buffers), front(0), out(f), verifiers(v),
+      pool(bp), verrors(0) {
     q=new CJ[buffers];
     if (!q) throw std::bad_alloc();
     init_mutex(mutex);
     empty.init(buffers);
     compressors.init(threads);
+    vready.init(0);
+    vslots.init(buffers);
     for (int i=0; i<buffers; ++i) {
       q[i].full.init(0);
       q[i].compressed.init(0);
@@ -1880,21 +3169,25 @@ public:
       q[i].compressed.destroy();
       q[i].full.destroy();
     }
+    vslots.destroy();
+    vready.destroy();
     compressors.destroy();
     empty.destroy();
     destroy_mutex(mutex);
     delete[] q;
   }      
   void write(StringBuffer& s, const char* filename, string method,
-             const char* comment=0);
+             const char* comment=0, const string& sha1s="");
   vector<int> csize;  // compressed block sizes
+  int verrors;        // number of blocks that failed -verify
 };
 
 // Write s at the back of the queue. Signal end of input with method=""
 void CompressJob::write(StringBuffer& s, const char* fn, string method,
-                        const char* comment) {
+                        const char* comment, const string& sha1s) {
   for (unsigned k=(method=="")?qsize:1; k>0; --k) {
     empty.wait();
+    const int mb=(pool && method!="") ? pool->take(s.size()) : 0;
     lock(mutex);
     unsigned i, j;
     for (i=0; i<qsize; ++i) {
@@ -1902,6 +3195,8 @@ void CompressJob::write(StringBuffer& s, const char* fn, string method,
         q[j].filename=fn?fn:"";
         q[j].comment=comment?comment:"jDC\x01";
         q[j].method=method;
+        q[j].sha1s=sha1s;
+        q[j].mb=mb;
         q[j].in.resize(0);
         q[j].in.swap(s);
         q[j].state=CJ::FULL;
@@ -1914,6 +3209,71 @@ void CompressJob::write(StringBuffer& s, const char* fn, string method,
   }
 }
 
+// Number of -threads not compressing a block. When there are fewer
+// blocks left than threads, LZ77 match finding borrows the idle ones
+// through libzpaq::parallelFor. May be negative while in use.
+class IdleCores {
+  Mutex mutex;
+  int n;
+public:
+  IdleCores(): n(0) {init_mutex(mutex);}
+  void add(int k) {lock(mutex); n+=k; release(mutex);}
+  int take(int k) {  // take up to k, return number taken
+    lock(mutex);
+    k=max(0, min(k, n));
+    n-=k;
+    release(mutex);
+    return k;
+  }
+} idleCores;
+
+// Tasks f(arg, 0..n-1) of a runParallel() call
+struct ParallelJob {
+  void (*f)(void*, int);
+  void* arg;
+  int n;                 // number of tasks
+  int next;              // next task to run
+  Mutex mutex;           // protects next
+};
+
+// Run tasks until none are left
+ThreadReturn parallelThread(void* arg) {
+  ParallelJob& job=*(ParallelJob*)arg;
+  try {
+    while (true) {
+      lock(job.mutex);
+      const int i=job.next++;
+      release(job.mutex);
+      if (i>=job.n) break;
+      job.f(job.arg, i);
+    }
+  }
+  catch (std::exception& e) {
+    fflush(stdout);
+    fprintf(stderr, "zpaq exiting from parallelThread: %s\n", e.what());
+    exit(1);
+  }
+  return 0;
+}
+
+// libzpaq::parallelFor: run f(arg, 0..n-1) in this thread and any idle
+// cores, and return the number of threads used
+int runParallel(void (*f)(void*, int), void* arg, int n) {
+  ParallelJob job;
+  job.f=f;
+  job.arg=arg;
+  job.n=n;
+  job.next=0;
+  init_mutex(job.mutex);
+  vector<ThreadID> tid(idleCores.take(n-1));
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], parallelThread, &job);
+  parallelThread(&job);
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  idleCores.add(tid.size());
+  destroy_mutex(job.mutex);
+  return tid.size()+1;
+}
+
 // Compress data in the background, one per buffer
 ThreadReturn compressThread(void* arg) {
   CompressJob& job=*(CompressJob*)arg;
@@ -1944,9 +3304,13 @@ ThreadReturn compressThread(void* arg) {
       cj.state=CJ::COMPRESSING;
       release(job.mutex);
       job.compressors.wait();
+      if (job.pool) job.pool->cpu.wait();
+      idleCores.add(-1);
       libzpaq::compressBlock(&cj.in, &cj.out, cj.method.c_str(),
           cj.filename.c_str(), cj.comment=="" ? 0 : cj.comment.c_str());
       cj.in.resize(0);
+      idleCores.add(1);
+      if (job.pool) job.pool->cpu.signal();
       lock(job.mutex);
       cj.state=CJ::COMPRESSED;
       cj.compressed.signal();
@@ -1976,10 +3340,12 @@ ThreadReturn writeThread(void* arg) {
       CJ& cj=job.q[job.front];  // no other threads move front
       cj.compressed.wait();
 
-      // Quit if end of input
+      // Quit if end of input. Tell verifyThreads to quit too.
       lock(job.mutex);
       if (cj.method=="") {
+        for (int i=0; i<job.verifiers; ++i) job.vq.push_back(0);
         release(job.mutex);
+        for (int i=0; i<job.verifiers; ++i) job.vready.signal();
         return 0;
       }
 
@@ -2001,7 +3367,23 @@ ThreadReturn writeThread(void* arg) {
         job.out->write(p, n);
         lock(job.mutex);
       }
+
+      // Pass the block to a verifyThread. Wait if too many are pending.
+      if (job.verifiers>0 && cj.out.size()>0) {
+        release(job.mutex);
+        job.vslots.wait();
+        VJ* vj=new VJ;
+        vj->out.swap(cj.out);
+        vj->filename=cj.filename;
+        vj->sha1s.swap(cj.sha1s);
+        lock(job.mutex);
+        job.vq.push_back(vj);
+        job.vready.signal();
+      }
       cj.out.resize(0);
+      cj.sha1s="";
+      if (job.pool) job.pool->give(cj.mb);
+      cj.mb=0;
       cj.state=CJ::EMPTY;
       job.front=(job.front+1)%job.qsize;
       job.empty.signal();
@@ -2016,6 +3398,81 @@ ThreadReturn writeThread(void* arg) {
   return 0;
 }
 
+// Decompress blocks written by writeThread and compare the SHA-1 of each
+// segment to its stored checksum and, for D blocks, each fragment to
+// its hash in the index. Return the number of mismatches.
+static int verifyBlock(VJ& vj) {
+  int errs=0;
+  StringBuffer out;
+  libzpaq::Decompresser d;
+  d.setInput(&vj.out);
+  while (d.findBlock()) {
+    while (d.findFilename()) {
+      d.readComment();
+      libzpaq::SHA1 sha1;
+      d.setOutput(&out);
+      d.setSHA1(&sha1);
+      d.decompress();
+      char sum[21]={0};
+      d.readSegmentEnd(sum);
+      if (sum[0]==1 && memcmp(sum+1, sha1.result(), 20)) ++errs;
+    }
+  }
+
+  // Check fragments of a D block: frags, sizes[frags][4], 0[4], frags[4]
+  const unsigned nf=vj.sha1s.size()/20;
+  if (nf>0) {
+    const char* p=out.c_str();
+    const char* end=p+out.size();
+    if (out.size()<8+nf*4) return errs+1;
+    const char* s=end-4;
+    if (btoi(s)!=nf) return errs+1;
+    s=end-8-nf*4;
+    for (unsigned i=0; i<nf; ++i) {
+      const unsigned sz=btoi(s);
+      if (p+sz>end-8-nf*4) return errs+1;
+      libzpaq::SHA1 sha1;
+      sha1.write(p, sz);
+      if (memcmp(sha1.result(), vj.sha1s.c_str()+i*20, 20)) ++errs;
+      p+=sz;
+    }
+    if (p!=end-8-nf*4) ++errs;
+  }
+  return errs;
+}
+
+// Verify written blocks in the background, sharing compressors
+ThreadReturn verifyThread(void* arg) {
+  CompressJob& job=*(CompressJob*)arg;
+  while (true) {
+    job.vready.wait();
+    lock(job.mutex);
+    VJ* vj=job.vq.front();
+    job.vq.pop_front();
+    release(job.mutex);
+    if (!vj) return 0;
+    job.compressors.wait();
+    int errs=0;
+    try {
+      errs=verifyBlock(*vj);
+    }
+    catch (std::exception&) {
+      errs=1;
+    }
+    job.compressors.signal();
+    lock(job.mutex);
+    if (errs) {
+      fflush(stdout);
+      fprintf(stderr, "Verify failed: %s\n", vj->filename.c_str());
+      ++job.verrors;
+    }
+    release(job.mutex);
+    delete vj;
+    job.vslots.signal();
+  }
+  return 0;
+}
+
 // Write a ZPAQ compressed JIDAC block header. Output size should not
 // depend on input data.
 void writeJidacHeader(libzpaq::Writer *out, int64_t date,
@@ -2028,6 +3485,107 @@ void writeJidacHeader(libzpaq::Writer *out, int64_t date,
       ("jDC"+itos(date, 14)+"c"+itos(htsize, 10)).c_str(), "jDC\x01");
 }
 
+// A Fragmenter splits a file into fragments for deduplication. Boundaries
+// are where a rolling hash of the contents falls below a threshold, or
+// with -fixed, at offsets that are multiples of a fixed size. For each
+// fragment it also computes order 1 statistics used to analyze blocks.
+class Fragmenter {
+  FP in;                  // file to read
+  const unsigned minf;    // minimum content-defined fragment size
+  const unsigned maxf;    // maximum fragment size
+  const unsigned limit;   // boundary where hash < limit
+  const unsigned fixed;   // fixed fragment size or 0 if content-defined
+  enum {BUFSIZE=4096};
+  char buf[BUFSIZE];      // input buffer
+  int bufptr, buflen;     // read pointer and limit
+  int64_t left;           // bytes left to read, or -1 for all
+  unsigned read(char* p, unsigned n) {  // read up to n bytes to p
+    if (left>=0 && n>left) n=left;
+    n=fread(p, 1, n, in);
+    if (left>=0) left-=n;
+    return n;
+  }
+public:
+  Fragmenter(FP f, unsigned mn, unsigned mx, int fragment, unsigned fx=0):
+      in(f), minf(mn), maxf(mx),
+      limit(fragment<=22 ? 1u<<(22-fragment) : 0),
+      fixed(fx>0 && fx<mx ? fx : fx>0 ? mx : 0), bufptr(0), buflen(0),
+      left(-1) {}
+
+  // Read only the n bytes of the file starting at pos. Fragments do
+  // not cross the end, which is reported as eof.
+  void range(int64_t pos, int64_t n) {
+    fseeko(in, pos, SEEK_SET);
+    bufptr=buflen=0;
+    left=n;
+  }
+
+  // Read only the next n bytes without seeking, as from a tar stream.
+  // Return the number of them not yet read after eof.
+  void take(int64_t n) {bufptr=buflen=0; left=n;}
+  int64_t untaken() const {return left;}
+
+  // Read the next fragment into frag[0..sz-1] and return sz. Put its hash
+  // in sha1result[0..19], its order 1 context -> last byte predictions in
+  // o1[0..255], and the number of correct predictions in hits.
+  // Set eof to true if it is the last fragment.
+  unsigned next(char* frag, char* sha1result, unsigned char* o1,
+                unsigned& hits, bool& eof);
+};
+
+unsigned Fragmenter::next(char* frag, char* sha1result, unsigned char* o1,
+                          unsigned& hits, bool& eof) {
+  unsigned sz=0;  // fragment size
+  int c1=0;  // previous byte
+  hits=0;
+  memset(o1, 0, 256);
+  eof=false;
+  libzpaq::SHA1 sha1;
+
+  // Fixed size: read in bulk without a rolling hash
+  if (fixed) {
+    sz=buflen-bufptr;
+    if (sz>fixed) sz=fixed;
+    memcpy(frag, buf+bufptr, sz);
+    bufptr+=sz;
+    if (sz<fixed) sz+=read(frag+sz, fixed-sz);
+    for (unsigned i=0; i<sz; ++i) {
+      const int c=frag[i]&255;
+      hits+=(c==o1[c1]);
+      o1[c1]=c;
+      c1=c;
+    }
+    sha1.write(frag, sz);
+    if (bufptr>=buflen) bufptr=0, buflen=read(buf, BUFSIZE);
+    eof=bufptr>=buflen;
+  }
+
+  // Content-defined
+  else {
+    unsigned h=0;  // rolling hash for finding fragment boundaries
+    while (true) {
+      if (bufptr>=buflen) bufptr=0, buflen=read(buf, BUFSIZE);
+      if (bufptr>=buflen) {
+        eof=true;
+        break;
+      }
+      const int c=(unsigned char)buf[bufptr++];
+      if (c==o1[c1]) h=(h+c+1)*314159265u, ++hits;
+      else h=(h+c+1)*271828182u;
+      o1[c1]=c;
+      c1=c;
+      sha1.put(c);
+      frag[sz++]=c;
+      if (sz>=maxf || (h<limit && sz>=minf))
+        break;
+    }
+  }
+  assert(sz<=maxf);
+  assert(sz==sha1.usize());
+  memcpy(sha1result, sha1.result(), 20);
+  return sz;
+}
+
 // Maps sha1 -> fragment ID in ht with known size
 class HTIndex {
   vector<HT>& htr;  // reference to ht
@@ -2101,83 +3659,535 @@ struct WriterPair: public libzpaq::Writer {
   WriterPair(): a(0), b(0) {}
 };
 
-// Add or delete files from archive. Return 1 if error else 0.
-int Jidac::add() {
-
-  // Read archive or index into ht, dt, ver.
-  int errors=0;
-  const bool archive_exists=exists(subpart(archive, 1).c_str());
-  string arcname=archive;  // input archive name
-  if (index) arcname=index;
-  int64_t header_pos=0;
-  if (exists(subpart(arcname, 1).c_str()))
-    header_pos=read_archive(arcname.c_str(), &errors);
+// Return true if external file p in edt is to be compressed, where a is
+// the matching file in dt or dt.end()
+bool Jidac::isadded(DTMap::iterator p, DTMap::iterator a) {
+  return p->second.date && p->first!="" && p->first[p->first.size()-1]!='/'
+      && (force || a==dt.end()
+          || p->second.date!=a->second.date
+          || p->second.size!=a->second.size);
+}
 
-  // Set arcname, offset, header_pos, and salt to open out archive
-  arcname=archive;  // output file name
-  int64_t offset=0;  // total size of existing parts
-  char salt[32]={0};  // encryption salt
-  if (password) libzpaq::random(salt, 32);
+// Mark the files in dt that are in edt to keep. List in vf the files in
+// edt to be compressed, sorted by filename extension and decreasing size.
+// Return their total size.
+int64_t Jidac::sortFiles(vector<DTMap::iterator>& vf) {
+  int64_t total_size=0;
+  vf.clear();
+  for (DTMap::iterator p=edt.begin(); p!=edt.end(); ++p) {
+    DTMap::iterator a=dt.find(rename(p->first));
+    if (a!=dt.end()) a->second.data=1;  // keep
 
-  // Remote archive
-  if (index) {
-    if (dcsize>0) error("index is a regular archive");
-    if (version!=DEFAULT_VERSION) error("cannot truncate with an index");
-    offset=header_pos+dhsize;
-    header_pos=32*(password && offset==0);
-    arcname=subpart(archive, ver.size());
-    if (exists(arcname.c_str())) {
-      printUTF8(arcname.c_str(), stderr);
-      fprintf(stderr, ": archive exists\n");
-      error("archive exists");
-    }
-    if (password) {  // derive archive salt from index
-      FP fp=fopen(index, RB);
-      if (fp!=FPNULL) {
-        if (fread(salt, 1, 32, fp)!=32) error("cannot read salt from index");
-        salt[0]^='7'^'z';
-        fclose(fp);
+    // With -hashcache, keep a file with a new date but the same size and
+    // contents as stored, rather than add it again
+    if (hashcache.on() && !force && !tar && a!=dt.end() && a->second.hash[0]
+        && p->second.date && p->second.date!=a->second.date
+        && p->second.size==a->second.size) {
+      char h[20];
+      if (hashFile(p->first, h) && !memcmp(h, a->second.hash+1, 20)) {
+        p->second.date=a->second.date;
+        memcpy(p->second.hash, a->second.hash, 21);
       }
     }
-  }
+    if (isadded(p, a) && p->second.ptr.size()) p->second.data=1;  // tar link
+    else if (isadded(p, a)) {
+      total_size+=p->second.size;
 
-  // Local single or multi-part archive
-  else {
-    int parts=0;  // number of existing parts in multipart
-    string part0=subpart(archive, 0);
-    if (part0!=archive) {  // multi-part?
-      for (int i=1;; ++i) {
-        string partname=subpart(archive, i);
-        if (partname==part0) error("too many archive parts");
-        FP fp=fopen(partname.c_str(), RB);
-        if (fp==FPNULL) break;
-        ++parts;
-        fseeko(fp, 0, SEEK_END);
-        offset+=ftello(fp);
-        fclose(fp);
+      // Key by first 5 bytes of filename extension, case insensitive
+      int sp=0;  // sortkey byte position
+      for (string::const_iterator q=p->first.begin(); q!=p->first.end(); ++q){
+        uint64_t c=*q&255;
+        if (c>='A' && c<='Z') c+='a'-'A';
+        if (c=='/') sp=0, p->second.data=0;
+        else if (c=='.') sp=8, p->second.data=0;
+        else if (sp>3) p->second.data+=c<<(--sp*8);
       }
-      header_pos=32*(password && parts==0);
-      arcname=subpart(archive, parts+1);
-      if (exists(arcname.c_str())) error("part exists");
-    }
 
-    // Get salt from first part if it exists
-    if (password) {
-      FP fp=fopen(subpart(archive, 1).c_str(), RB);
-      if (fp==FPNULL) {
-        if (header_pos>32) error("archive first part not found");
-        header_pos=32;
+      // Key by descending size rounded to 16K
+      int64_t s=p->second.size>>14;
+      if (s>=(1<<24)) s=(1<<24)-1;
+      p->second.data+=(1<<24)-s-1;
+      vf.push_back(p);
+    }
+  }
+  std::sort(vf.begin(), vf.end(), compareFilename);
+  return total_size;
+}
+
+// Return the -fixed fragment size for file p in edt, or 0 to find
+// fragment boundaries by content
+unsigned Jidac::fixedSize(DTMap::iterator p) {
+  if (!fixed) return 0;
+  if (fixedmin==0 && fixedfiles.size()==0) return fixed;
+  if (fixedmin>0 && p->second.size>=fixedmin) return fixed;
+  for (unsigned i=0; i<fixedfiles.size(); ++i)
+    if (ispath(fixedfiles[i].c_str(), p->first.c_str())) return fixed;
+  return 0;
+}
+
+// Return the -fragment value for a file of size bytes. Fragments are
+// twice as large for each factor of 4 that it is at least fragmin, so
+// huge files have fewer fragments and the choice is the same each time
+// a file of that size is added.
+int Jidac::fileFragment(int64_t size) {
+  int f=fragment;
+  if (fragmin>0 && size>=fragmin)
+    for (int64_t m=size/fragmin; m>0 && f<25; m>>=2) ++f;
+  return f;
+}
+
+// With estimate, select the parts of a file of size n to read and put
+// them in r as (offset, length) pairs, merging adjacent parts. Files are
+// split into 1 MiB chunks. Each is selected with probability sample/100
+// by a hash of the file size and chunk number, so identical files are
+// sampled alike and deduplication between them is still found.
+void Jidac::sampleRanges(int64_t n, vector<int64_t>& r) {
+  const int64_t CHUNK=1<<20;
+  const double p=sample/100;
+  for (int64_t k=0; k==0 || k*CHUNK<n; ++k) {
+    uint64_t h=(n*0x9E3779B97F4A7C15ull+k+1)*0xBF58476D1CE4E5B9ull;
+    h^=h>>31;
+    h*=0x94D049BB133111EBull;
+    h^=h>>29;
+    if (p<1 && h>=p*18446744073709551616.0) continue;
+    const int64_t len=n-k*CHUNK<CHUNK ? n-k*CHUNK : CHUNK;
+    if (r.size() && r[r.size()-2]+r.back()==k*CHUNK) r.back()+=len;
+    else r.push_back(k*CHUNK), r.push_back(len);
+  }
+}
+
+// Return sum(y)/sum(x) of a sample and set ci to the half width of its
+// 95% confidence interval, or -1 if there are too few elements. The
+// sample is fraction f of the population.
+static double ratioEstimate(const vector<double>& x, const vector<double>& y,
+                            double f, double& ci) {
+  double sx=0, sy=0, ss=0;
+  const unsigned n=x.size();
+  for (unsigned i=0; i<n; ++i) sx+=x[i], sy+=y[i];
+  if (sx<=0) return ci=-1, 0;
+  const double r=sy/sx;
+  for (unsigned i=0; i<n; ++i) ss+=(y[i]-r*x[i])*(y[i]-r*x[i]);
+  ci=-1;
+  if (n>1 && f<1) ci=1.96*sqrt(ss/(n*(n-1.0))*(1-f))*n/sx;
+  else if (n>1) ci=0;
+  return r;
+}
+
+// Read the next record of a run or close it at the end
+bool Run::next() {
+  if (!f) return false;
+  filename="";
+  int c;
+  while ((c=getc(f))!=EOF && c) filename+=char(c);
+  char buf[24];
+  if (c==EOF || fread(buf, 1, 24, f)!=24) {
+    fclose(f);
+    f=0;
+    return false;
+  }
+  const char* s=buf;
+  d.date=btol(s);
+  d.size=btol(s);
+  d.attr=btol(s);
+  return true;
+}
+
+// Read exactly n bytes of tar input to p, or skip them if p is NULL.
+// Return false at end of input.
+bool TarReader::read(char* p, int64_t n) {
+  char buf[4096];
+  while (n>0) {
+    const size_t r=fread(p ? p : buf, 1, p ? n : min(n, int64_t(4096)), f);
+    if (r==0) return false;
+    if (p) p+=r;
+    n-=r;
+  }
+  return true;
+}
+
+// Return the number in a tar header field of n bytes, in octal or,
+// if the high bit of the first byte is set, in base 256.
+int64_t tarNumber(const char* s, int n) {
+  int64_t x=0;
+  if (s[0]&0x80) {
+    x=s[0]&0x3f;
+    for (int i=1; i<n; ++i) x=x<<8|(s[i]&255);
+    return x;
+  }
+  for (int i=0; i<n && s[i]>='0' && s[i]<='7'; ++i) x=x*8+s[i]-'0';
+  if (n>0 && s[0]==' ') return tarNumber(s+1, n-1);
+  return x;
+}
+
+bool TarReader::next() {
+  string longname, longlink;  // from pax or GNU headers
+  int64_t paxsize=-1;
+  double paxmtime=-1;
+  char h[512];
+  while (true) {
+    if (!read(0, skip)) return err="tar input truncated", false;
+    if (!read(h, 512)) return false;
+    skip=0;
+    int sum=0;  // header checksum with its own field as spaces
+    for (int i=0; i<512; ++i) sum+=i>=148 && i<156 ? ' ' : h[i]&255;
+    if (sum==256) return false;  // zero block marks end of archive
+    if (sum!=tarNumber(h+148, 8)) return err="bad tar header checksum", false;
+    type=h[156] ? h[156] : '0';
+    size=tarNumber(h+124, 12);
+    skip=(size+511)&-512;
+
+    // Get long names and pax records for the next member
+    if (type=='x' || type=='g' || type=='L' || type=='K') {
+      if (size>(1<<24)) return err="tar extended header too big", false;
+      string d(size, '\0');
+      if (!read(&d[0], size)) return err="tar input truncated", false;
+      skip-=size;
+      if (type=='L') longname=d.c_str();
+      if (type=='K') longlink=d.c_str();
+      for (size_t i=0; type=='x' && i<d.size();) {  // "len key=value\n"
+        const size_t len=atol(d.c_str()+i);
+        const size_t sp=d.find(' ', i), eq=d.find('=', i);
+        if (len<1 || i+len>d.size() || sp>=eq || eq>=i+len) break;
+        const string key=d.substr(sp+1, eq-sp-1);
+        const string value=d.substr(eq+1, i+len-eq-2);
+        if (key=="path") longname=value;
+        else if (key=="linkpath") longlink=value;
+        else if (key=="size") paxsize=int64_t(atof(value.c_str()));
+        else if (key=="mtime") paxmtime=atof(value.c_str());
+        i+=len;
       }
-      else {
-        if (fread(salt, 1, 32, fp)!=32) error("cannot read salt");
-        fclose(fp);
+      continue;
+    }
+
+    // Get fields of a ustar or old tar header
+    name=string(h, strnlen(h, 100));
+    if (!memcmp(h+257, "ustar", 5) && h[345])
+      name=string(h+345, strnlen(h+345, 155))+"/"+name;
+    link=string(h+157, strnlen(h+157, 100));
+    mtime=tarNumber(h+136, 12);
+    mode=tarNumber(h+100, 8)&07777;
+    if (longname!="") name=longname;
+    if (longlink!="") link=longlink;
+    if (paxsize>=0) size=paxsize, skip=(size+511)&-512;
+    if (paxmtime>=0) mtime=int64_t(paxmtime);
+    if (type=='7') type='0';  // contiguous file
+    while (name.size()>2 && name.substr(0, 2)=="./") name=name.substr(2);
+    if (link.size()>2 && link.substr(0, 2)=="./") link=link.substr(2);
+    if (type=='5' && name!="" && name[name.size()-1]!='/') name+="/";
+    return true;
+  }
+}
+
+// With add -tar, replace edt with the next selected member of tarin.
+// Its data is read in place by add(), which reduces tarin.skip. A hard
+// link gets the fragment list of its target. Return true at the end.
+bool Jidac::nextTar() {
+  edt.clear();
+  while (tarin.next()) {
+    const char type=tarin.type;
+    if (type!='0' && type!='1' && type!='5') {
+      printUTF8(tarin.name.c_str());
+      printf(": tar member type %c not supported, skipping...\n", type);
+      continue;
+    }
+    if (tarin.name=="" || tarin.name=="./"
+        || !isselected(tarin.name.c_str())) continue;
+    DT& d=edt[tarin.name];
+    d.date=decimal_time(tarin.mtime);
+    d.size=type=='0' ? tarin.size : 0;
+    d.attr=noattributes ? 0 : 'u'+((tarin.mode|(type=='5' ? 040000 : 0100000))
+        <<8);
+    d.data=0;
+    if (type=='1') {  // hard link to an earlier file
+      const vector<unsigned>* ptr=0;
+      map<string, vector<unsigned> >::iterator t=tarptr.find(tarin.link);
+      DTMap::iterator a=dt.find(rename(tarin.link));
+      if (t!=tarptr.end()) ptr=&t->second;
+      else if (a!=dt.end() && a->second.date) ptr=&a->second.ptr;
+      if (!ptr || ptr->size()==0 || method[0]=='s') {
+        printUTF8(tarin.name.c_str());
+        printf(": tar link to ");
+        printUTF8(tarin.link.c_str());
+        printf(" not found, skipping...\n");
+        edt.clear();
+        continue;
+      }
+      d.ptr=*ptr;
+      for (unsigned i=0; i<d.ptr.size(); ++i)
+        d.size+=ht[d.ptr[i]].usize;
+    }
+    return false;
+  }
+  if (tarin.err) {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", tarin.err);
+  }
+  return true;
+}
+
+// Append a run record filename NUL date[8] size[8] attr[8] to sb
+static void putRun(StringBuffer& sb, const string& filename, const DT& d) {
+  sb.write(filename.c_str(), filename.size()+1);
+  puti(sb, d.date, 8);
+  puti(sb, d.size, 8);
+  puti(sb, d.attr, 8);
+}
+
+// Save edt to a sorted run in a temporary file and clear it
+void Jidac::spill() {
+  if (edt.size()==0) return;
+  FILE* f=tmpfile();
+  if (!f) ioerr("tmpfile");
+  StringBuffer sb;
+  for (DTMap::iterator p=edt.begin();; ++p) {
+    if (p!=edt.end()) putRun(sb, p->first, p->second);
+    if (sb.size()>=(1<<16) || (sb.size()>0 && p==edt.end())) {
+      if (fwrite(sb.c_str(), 1, sb.size(), f)!=sb.size()) ioerr("tmpfile");
+      sb.resize(0);
+    }
+    if (p==edt.end()) break;
+  }
+  rewind(f);
+  runs.push_back(Run(f));
+  runs.back().next();
+  edt.clear();
+  edtmem=0;
+}
+
+// Merge the runs into one, keeping only the first record of a file
+// scanned more than once by overlapping arguments. Count the files to
+// be added in run_size and run_files.
+void Jidac::mergeRuns() {
+  FILE* f=tmpfile();
+  if (!f) ioerr("tmpfile");
+  StringBuffer sb;
+  string last;  // filename of last record written
+  bool any=false;
+  while (true) {
+    int k=-1;  // run with the lowest filename
+    for (unsigned i=0; i<runs.size(); ++i)
+      if (runs[i].f && (k<0 || runs[i].filename<runs[k].filename)) k=i;
+    if (k>=0 && (!any || runs[k].filename!=last)) {
+      Run& r=runs[k];
+      DTMap::iterator p=edt.insert(std::make_pair(r.filename, r.d)).first;
+      if (isadded(p, dt.find(rename(p->first))))
+        run_size+=p->second.size, ++run_files;
+      edt.clear();
+      putRun(sb, r.filename, r.d);
+      last=r.filename;
+      any=true;
+    }
+    if (sb.size()>=(1<<16) || (sb.size()>0 && k<0)) {
+      if (fwrite(sb.c_str(), 1, sb.size(), f)!=sb.size()) ioerr("tmpfile");
+      sb.resize(0);
+    }
+    if (k<0) break;
+    runs[k].next();
+  }
+  rewind(f);
+  runs.clear();
+  runs.push_back(Run(f));
+  runs.back().next();
+}
+
+// Refill edt by merging the runs in filename order until it would use
+// more than half of -memory including fragment lists. Return true if
+// this is the last batch.
+bool Jidac::nextBatch() {
+  edt.clear();
+  edtmem=0;
+  while (true) {
+    int k=-1;  // run with the lowest filename
+    for (unsigned i=0; i<runs.size(); ++i)
+      if (runs[i].f && (k<0 || runs[i].filename<runs[k].filename)) k=i;
+    if (k<0) return true;
+    Run& r=runs[k];
+    if (edtmem>memory/2 && r.filename!=edt.rbegin()->first) return false;
+    edt[r.filename]=r.d;
+    edtmem+=sizeof(DT)+r.filename.size()+80+(r.d.size>>(10+fragment))*4;
+    r.next();
+  }
+}
+
+// Append to is the attribute list na[4] attr[na] of a file with
+// attributes attr. If hash[0] is 1 then the attributes are padded to 8
+// bytes and followed by the SHA-1 of the contents in hash[1..20].
+// Readers that keep only the first 8 attribute bytes ignore it.
+static void putAttr(StringBuffer& is, int64_t attr, const char* hash) {
+  int na=0;
+  if ((attr&255)=='u') na=3;  // unix attributes
+  else if ((attr&255)=='w') na=5;  // windows attributes
+  puti(is, hash[0] ? 28 : na, 4);
+  puti(is, attr, na);
+  if (hash[0]) {
+    puti(is, 0, 8-na);
+    is.write(hash+1, 20);
+  }
+}
+
+// Append to ib the index (I block) records of the files in edt that are
+// new or changed, in chunks of about 16 KB, each preceded by its size[4].
+void Jidac::indexFiles(StringBuffer& ib, int& added) {
+  StringBuffer is;
+  for (DTMap::iterator p=edt.begin();; ++p) {
+    if (p!=edt.end()) {
+      string filename=rename(p->first);
+      DTMap::iterator a=dt.find(filename);
+      if (p->second.date && (a==dt.end() // new file
+         || a->second.date!=p->second.date  // date change
+         || (a->second.attr && a->second.attr!=p->second.attr)  // attr ch.
+         || a->second.size!=p->second.size  // size change
+         || (p->second.data && a->second.ptr!=p->second.ptr))) { // content
+        if (summary<=0 && p->second.data==0) {  // not compressed?
+          if (a==dt.end() || a->second.date==0) printf("+ ");
+          else printf("# ");
+          printUTF8(p->first.c_str());
+          if (filename!=p->first) {
+            printf(" -> ");
+            printUTF8(filename.c_str());
+          }
+          printf("\n");
+        }
+        ++added;
+        puti(is, p->second.date, 8);
+        is.write(filename.c_str(), strlen(filename.c_str()));
+        is.put(0);
+        if (a==dt.end() || p->second.data) a=p;  // use new frag pointers
+        putAttr(is, p->second.attr, a->second.hash);
+        puti(is, a->second.ptr.size(), 4);  // list of frag pointers
+        for (unsigned i=0; i<a->second.ptr.size(); ++i)
+          puti(is, a->second.ptr[i], 4);
+      }
+    }
+    if (is.size()>16000 || (is.size()>0 && p==edt.end())) {
+      puti(ib, is.size(), 4);
+      ib.write(is.c_str(), is.size());
+      is.resize(0);
+    }
+    if (p==edt.end()) break;
+  }
+}
+
+// Replace the name of the first segment of the ZPAQ block in buf[0..n-1],
+// starting with a 13 byte tag, by newname of the same length. Return
+// false if the name is not oldname.
+static bool renameBlock(char* buf, int64_t n, const string& oldname,
+                        const string& newname) {
+  assert(oldname.size()==newname.size());
+  if (n<20) return false;
+  const int64_t p=21+(buf[18]&255)+(buf[19]&255)*256;  // filename
+  if (p+int64_t(oldname.size())>n || buf[p-1]!=1
+      || memcmp(buf+p, oldname.c_str(), oldname.size()))
+    return false;
+  memcpy(buf+p, newname.c_str(), newname.size());
+  return true;
+}
+
+// Add delta to the fragment IDs of at least first in the pointer lists
+// of an index block is: {date[8] filename 0 na[4] attr[na] ni[4] ptr[ni][4]
+// or 0[8] filename 0}...
+static void renumber(StringBuffer& is, unsigned first, unsigned delta) {
+  unsigned char* s=is.data();
+  unsigned char* const end=s+is.size();
+  while (s+9<=end) {
+    bool del=true;  // deleted?
+    for (int i=0; i<8; ++i) if (*s++) del=false;
+    while (s<end && *s) ++s;
+    if (++s>end || del) continue;
+    if (s+4>end) break;
+    s+=4+(s[0]|s[1]<<8|s[2]<<16|unsigned(s[3])<<24);
+    if (s+4>end) break;
+    unsigned ni=s[0]|s[1]<<8|s[2]<<16|unsigned(s[3])<<24;
+    for (s+=4; ni>0 && s+4<=end; --ni, s+=4) {
+      const unsigned id=s[0]|s[1]<<8|s[2]<<16|unsigned(s[3])<<24;
+      if (id>=first) {
+        const unsigned r=id+delta;
+        s[0]=r, s[1]=r>>8, s[2]=r>>16, s[3]=r>>24;
+      }
+    }
+  }
+}
+
+// Add or delete files from archive. Return 1 if error else 0.
+int Jidac::add() {
+
+  // Read archive or index into ht, dt, ver. With -concurrent, hold the
+  // lock so that no other writer is committing.
+  int errors=0;
+  if (concurrent && (index || command=='e' || version!=DEFAULT_VERSION))
+    error("-concurrent cannot be used with -index, -until, or estimate");
+  if (concurrent && (storage!=&localStorage || subpart(archive, 0)!=archive))
+    error("-concurrent needs a local single part archive");
+  const bool archive_exists=storage->size(subpart(archive, 1))>=0;
+  string arcname=archive;  // input archive name
+  if (index) arcname=index;
+  int64_t header_pos=0;
+  {
+    ArchiveLock alock(concurrent ? archive.c_str() : 0);
+    if (storage->size(subpart(arcname, 1))>=0)
+      header_pos=read_archive(arcname.c_str(), &errors);
+  }
+
+  // Set arcname, offset, header_pos, and salt to open out archive
+  arcname=archive;  // output file name
+  int64_t offset=0;  // total size of existing parts
+  char salt[32]={0};  // encryption salt
+  if (password) libzpaq::random(salt, 32);
+
+  // Remote archive
+  if (index) {
+    if (dcsize>0) error("index is a regular archive");
+    if (version!=DEFAULT_VERSION) error("cannot truncate with an index");
+    offset=header_pos+dhsize;
+    header_pos=32*(password && offset==0);
+    arcname=subpart(archive, ver.size());
+    if (storage->size(arcname)>=0) {
+      printUTF8(arcname.c_str(), stderr);
+      fprintf(stderr, ": archive exists\n");
+      error("archive exists");
+    }
+    if (password) {  // derive archive salt from index
+      const int r=storage->read(index, 0, salt, 32);
+      if (r>=0 && r!=32) error("cannot read salt from index");
+      if (r>=0) salt[0]^='7'^'z';
+    }
+  }
+
+  // Single or multi-part archive
+  else {
+    string part0=subpart(archive, 0);
+    if (part0!=archive) {  // multi-part?
+      vector<string> names;  // existing parts
+      vector<int64_t> sizes;
+      storage->parts(archive, names, sizes);
+      const unsigned parts=names.size();
+      for (unsigned i=0; i<parts; ++i) offset+=sizes[i];
+      header_pos=32*(password && parts==0);
+      arcname=subpart(archive, parts+1);
+      if (arcname==part0) error("too many archive parts");
+      if (storage->size(arcname)>=0) error("part exists");
+    }
+
+    // Get salt from first part if it exists
+    if (password) {
+      const int r=storage->read(subpart(archive, 1), 0, salt, 32);
+      if (r<0) {
+        if (header_pos>32) error("archive first part not found");
+        header_pos=32;
       }
+      else if (r!=32) error("cannot read salt");
     }
   }
-  if (exists(arcname.c_str())) printf("Updating ");
-  else printf("Creating ");
-  printUTF8(arcname.c_str());
-  printf(" at offset %1.0f + %1.0f\n", double(header_pos), double(offset));
+  if (command=='e') {  // estimate: compress but do not write
+    if (index) error("cannot estimate with -index");
+    arcname="";
+  }
+  else {
+    if (storage->size(arcname)>=0) printf("Updating ");
+    else printf("Creating ");
+    printUTF8(arcname.c_str());
+    printf(" at offset %1.0f + %1.0f\n", double(header_pos), double(offset));
+  }
 
   // Set method
   if (method=="") method="1";
@@ -2189,16 +4199,14 @@ int Jidac::add() {
     error("-method must begin with 0..5, x, s");
   assert(method.size()>=2);
   if (method[0]=='s' && index) error("cannot index in streaming mode");
+  if (method[0]=='s' && command=='e') error("cannot estimate streaming mode");
+  if (method[0]=='s' && concurrent) error("-concurrent needs journaling mode");
 
   // Set block and fragment sizes
   if (fragment<0) fragment=0;
   const int log_blocksize=20+atoi(method.c_str()+1);
   if (log_blocksize<20 || log_blocksize>31) error("blocksize must be 0..11");
   const unsigned blocksize=(1u<<log_blocksize)-4096;
-  const unsigned MAX_FRAGMENT=fragment>19 || (8128u<<fragment)>blocksize-12
-      ? blocksize-12 : 8128u<<fragment;
-  const unsigned MIN_FRAGMENT=fragment>25 || (64u<<fragment)>MAX_FRAGMENT
-      ? MAX_FRAGMENT : 64u<<fragment;
 
   // Don't mix streaming and journaling
   for (unsigned i=0; i<block.size(); ++i) {
@@ -2210,66 +4218,87 @@ int Jidac::add() {
       error("cannot update streaming archive in journaling format");
   }
 
-  // Make list of files to add or delete
-  for (unsigned i=0; i<files.size(); ++i)
+  // Make list of files to add or delete. With -memory, edt is saved
+  // to sorted runs as it grows and read back in batches. With -tar,
+  // each batch is the next member of the tar input, and files only
+  // select members and the files to delete.
+  if (tar) {
+    if (command=='e') error("cannot estimate with -tar");
+#ifdef unix
+    tarin.f=tarfile ? fopen(tarfile, RB) : stdin;
+#else
+    tarin.f=tarfile ? fopen(tarfile, RB) : GetStdHandle(STD_INPUT_HANDLE);
+#endif
+    if (tarin.f==FPNULL) {
+      printerr(tarfile);
+      error("tar input not found");
+    }
+  }
+  for (unsigned i=0; i<files.size() && !tar; ++i)
     scandir(files[i].c_str());
+  if (runs.size()) spill(), mergeRuns();
 
   // Sort the files to be added by filename extension and decreasing size
   vector<DTMap::iterator> vf;
-  int64_t total_size=0;  // size of all input
+  int64_t total_size=run_size;  // size of all input
+  unsigned total_files=run_files;  // number of files to add
   int64_t total_done=0;  // input deduped so far
-  for (DTMap::iterator p=edt.begin(); p!=edt.end(); ++p) {
-    DTMap::iterator a=dt.find(rename(p->first));
-    if (a!=dt.end()) a->second.data=1;  // keep
-    if (p->second.date && p->first!="" && p->first[p->first.size()-1]!='/'
-        && (force || a==dt.end()
-            || p->second.date!=a->second.date
-            || p->second.size!=a->second.size)) {
-      total_size+=p->second.size;
-
-      // Key by first 5 bytes of filename extension, case insensitive
-      int sp=0;  // sortkey byte position
-      for (string::const_iterator q=p->first.begin(); q!=p->first.end(); ++q){
-        uint64_t c=*q&255;
-        if (c>='A' && c<='Z') c+='a'-'A';
-        if (c=='/') sp=0, p->second.data=0;
-        else if (c=='.') sp=8, p->second.data=0;
-        else if (sp>3) p->second.data+=c<<(--sp*8);
-      }
-
-      // Key by descending size rounded to 16K
-      int64_t s=p->second.size>>14;
-      if (s>=(1<<24)) s=(1<<24)-1;
-      p->second.data+=(1<<24)-s-1;
-      vf.push_back(p);
-    }
+  bool lastbatch=true;   // no more files in runs or tar?
+  if (tar) {
+    lastbatch=nextTar();
+    total_size=sortFiles(vf);
+    total_files=vf.size();
+  }
+  else if (runs.size()) {
+    lastbatch=nextBatch();
+    sortFiles(vf);
+  }
+  else {
+    total_size=sortFiles(vf);
+    total_files=vf.size();
   }
-  std::sort(vf.begin(), vf.end(), compareFilename);
 
-  // Test for reliable access to archive
-  if (archive_exists!=exists(subpart(archive, 1).c_str()))
+  // Test for reliable access to archive. Other -concurrent writers may
+  // have created it.
+  if (!concurrent && archive_exists!=(storage->size(subpart(archive, 1))>=0))
     error("archive access is intermittent");
 
-  // Open output
-  OutputArchive out(arcname.c_str(), password, salt, offset);
+  // Open output. With -concurrent, D blocks are staged in a temporary
+  // file and the archive is not opened until commit.
+  const bool out_existed=storage->size(arcname)>=0;
+  OutputArchive out(concurrent ? "" : arcname.c_str(), password, salt,
+                    offset);
   out.seek(header_pos, SEEK_SET);
+  StageWriter stage(concurrent);
 
   // Start compress and write jobs
   vector<ThreadID> tid(threads*2-1);
   ThreadID wid;
-  CompressJob job(threads, tid.size(), &out);
-  printf(
-      "Adding %1.6f MB in %d files -method %s -threads %d at %s.\n",
-      total_size/1000000.0, int(vf.size()), method.c_str(), threads,
+  vector<ThreadID> vid(verify ? threads : 0);
+  CompressJob job(threads, tid.size(),
+      concurrent ? (libzpaq::Writer*)&stage : &out, vid.size(), pool);
+  if (tar) {
+    printf("Adding from ");
+    printUTF8(tarfile ? tarfile : "standard input");
+    printf(" -method %s -threads %d at %s.\n", method.c_str(), threads,
+        dateToString(date).c_str());
+  }
+  else printf(
+      "%s %1.6f MB in %d files -method %s -threads %d at %s.\n",
+      command=='e' ? "Estimating" : "Adding",
+      total_size/1000000.0, int(total_files), method.c_str(), threads,
       dateToString(date).c_str());
+  if (!pool) idleCores.add(threads);  // batch adds them for all jobs
   for (unsigned i=0; i<tid.size(); ++i) run(tid[i], compressThread, &job);
   run(wid, writeThread, &job);
+  for (unsigned i=0; i<vid.size(); ++i) run(vid[i], verifyThread, &job);
 
   // Append in streaming mode. Each file is a separate block. Large files
   // are split into blocks of size blocksize.
   int64_t dedupesize=0;  // input size after dedupe
   if (method[0]=='s') {
     StringBuffer sb(blocksize+4096-128);
+    for (;;) {  // for each batch
     for (unsigned fi=0; fi<vf.size(); ++fi) {
       DTMap::iterator p=vf[fi];
       print_progress(total_size, total_done, summary);
@@ -2278,7 +4307,7 @@ int Jidac::add() {
         printUTF8(p->first.c_str());
         printf(" %1.0f\n", p->second.size+0.0);
       }
-      FP in=fopen(p->first.c_str(), RB);
+      FP in=tar ? tarin.f : fopen(p->first.c_str(), RB);
       if (in==FPNULL) {
         printerr(p->first.c_str());
         total_size-=p->second.size;
@@ -2289,7 +4318,9 @@ int Jidac::add() {
       const int BUFSIZE=4096;
       char buf[BUFSIZE];
       while (true) {
-        int r=fread(buf, 1, BUFSIZE, in);
+        int r=BUFSIZE;
+        if (tar && p->second.size-int64_t(i)<r) r=p->second.size-i;
+        r=fread(buf, 1, r, in);
         sb.write(buf, r);
         i+=r;
         if (r==0 || sb.size()+BUFSIZE>blocksize) {
@@ -2310,13 +4341,42 @@ int Jidac::add() {
         }
         if (r==0) break;
       }
-      fclose(in);
+      if (tar) tarin.skip-=i;  // if truncated, nextTar() reports it
+      else fclose(in);
+    }
+    if (lastbatch) break;
+    if (tar) {
+      lastbatch=nextTar();
+      total_size+=sortFiles(vf);
+      total_files+=vf.size();
     }
+    else {
+      lastbatch=nextBatch();
+      sortFiles(vf);
+    }
+    }
+    if (tar && tarfile) fclose(tarin.f);
+    if (tar && tarin.err) ++errors;
 
     // Wait for jobs to finish
     job.write(sb, 0, "");  // signal end of input
     for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
     join(wid);
+    for (unsigned i=0; i<vid.size(); ++i) join(vid[i]);
+    if (!pool) idleCores.add(-threads);
+
+    // Streaming blocks are written in place, so remove them if any
+    // failed to verify
+    if (job.verrors) {
+      const bool ok=out.truncate(header_pos);
+      out.close();
+      if (!out_existed) storage->remove(arcname);
+      if (!ok) {
+        printerr(arcname.c_str());
+        error("verify failed, archive holds unverified blocks");
+      }
+      error("verify failed, archive not updated");
+    }
 
     // Done
     const int64_t outsize=out.tell();
@@ -2340,12 +4400,13 @@ int Jidac::add() {
   }
 
   // Build htinv for fast lookups of sha1 in ht
-  HTIndex htinv(ht, ht.size()+(total_size>>(10+fragment))+vf.size());
+  HTIndex htinv(ht, ht.size()+(total_size>>(10+fragment))+total_files);
   const unsigned htsize=ht.size();  // fragments at start of update
 
   // reserve space for the header block
   writeJidacHeader(&out, date, -1, htsize);
-  const int64_t header_end=out.tell();
+  int64_t header_end=out.tell();
+  const int64_t stagedate=date;  // date in names of staged D blocks
 
   // Compress until end of last file
   assert(method!="");
@@ -2356,22 +4417,41 @@ int Jidac::add() {
   unsigned exe=0;      // number of fragments containing x86 (exe, dll)
   const int ON=4;      // number of order-1 tables to save
   unsigned char o1prev[ON*256]={0};  // last ON order 1 predictions
-  libzpaq::Array<char> fragbuf(MAX_FRAGMENT);
+  libzpaq::Array<char> fragbuf(0);  // fragment, resized for large files
   vector<unsigned> blocklist;  // list of starting fragments
-
-  // For each file to be added
-  for (unsigned fi=0; fi<=vf.size(); ++fi) {
+  StringBuffer ib;     // I block contents in chunks
+  FILE* ibf=0;         // with -memory, ib is saved here after each batch
+  int added=0;         // count
+  vector<int64_t> ranges;  // estimate: (offset, length) of parts to read
+  vector<double> bx, bd;   // estimate: input, deduped size of each block
+  int64_t bdone=0;     // estimate: input before current block
+  int sampled=0;       // estimate: files read
+  const int64_t start=mtime();
+
+  // For each file to be added. The last batch ends with fi==vf.size()
+  // to compress the last block.
+  for (;;) {
+  for (unsigned fi=0; fi<vf.size()+lastbatch; ++fi) {
     FP in=FPNULL;
-    const int BUFSIZE=4096;  // input buffer
-    char buf[BUFSIZE];
-    int bufptr=0, buflen=0;  // read pointer and limit
+    unsigned fixedsize=0;  // -fixed fragment size
+    libzpaq::SHA1 fhash;   // -hashcache: hash of whole file
+    string fstamp;         // -hashcache: stamp of file before reading
     if (fi<vf.size()) {
       assert(vf[fi]->second.ptr.size()==0);
       DTMap::iterator p=vf[fi];
 
+      // With estimate, read only sampled parts
+      ranges.clear();
+      if (command=='e') {
+        sampleRanges(p->second.size, ranges);
+        if (ranges.size()==0) continue;
+        ++sampled;
+      }
+
       // Open input file
-      bufptr=buflen=0;
-      in=fopen(p->first.c_str(), RB);
+      fixedsize=fixedSize(p);
+      if (hashcache.on() && !tar) HashCache::stamp(p->first, fstamp);
+      in=tar ? tarin.f : fopen(p->first.c_str(), RB);
       if (in==FPNULL) {  // skip if not found
         p->second.date=0;
         total_size-=p->second.size;
@@ -2384,41 +4464,31 @@ int Jidac::add() {
 
     // Read fragments
     int64_t fsize=0;  // file size after dedupe
+    const int ff=fi<vf.size() ? fileFragment(vf[fi]->second.size) : fragment;
+    const unsigned MAX_FRAGMENT=ff>19 || (8128u<<ff)>blocksize-12
+        ? blocksize-12 : 8128u<<ff;
+    const unsigned MIN_FRAGMENT=ff>25 || (64u<<ff)>MAX_FRAGMENT
+        ? MAX_FRAGMENT : 64u<<ff;
+    if (fragbuf.size()<MAX_FRAGMENT) fragbuf.resize(MAX_FRAGMENT);
+    Fragmenter fr(in, MIN_FRAGMENT, MAX_FRAGMENT, ff, fixedsize);
+    unsigned ri=0;  // index in ranges
+    if (in!=FPNULL && ranges.size()) fr.range(ranges[0], ranges[1]);
+    if (in!=FPNULL && tar) fr.take(vf[fi]->second.size);
     for (unsigned fj=0; true; ++fj) {
       int64_t sz=0;  // fragment size;
       unsigned hits=0;  // correct prediction count
-      int c=EOF;  // current byte
+      bool eof=true;  // last fragment?
       unsigned htptr=0;  // fragment index
       char sha1result[20]={0};  // fragment hash
       unsigned char o1[256]={0};  // order 1 context -> predicted byte
       if (fi<vf.size()) {
-        int c1=0;  // previous byte
-        unsigned h=0;  // rolling hash for finding fragment boundaries
-        libzpaq::SHA1 sha1;
         assert(in!=FPNULL);
-        while (true) {
-          if (bufptr>=buflen) bufptr=0, buflen=fread(buf, 1, BUFSIZE, in);
-          if (bufptr>=buflen) c=EOF;
-          else c=(unsigned char)buf[bufptr++];
-          if (c!=EOF) {
-            if (c==o1[c1]) h=(h+c+1)*314159265u, ++hits;
-            else h=(h+c+1)*271828182u;
-            o1[c1]=c;
-            c1=c;
-            sha1.put(c);
-            fragbuf[sz++]=c;
-          }
-          if (c==EOF
-              || sz>=MAX_FRAGMENT
-              || (fragment<=22 && h<(1u<<(22-fragment)) && sz>=MIN_FRAGMENT))
-            break;
-        }
+        sz=fr.next(&fragbuf[0], sha1result, o1, hits, eof);
         assert(sz<=MAX_FRAGMENT);
         total_done+=sz;
+        if (hashcache.on() && command!='e') fhash.write(&fragbuf[0], sz);
 
         // Look for matching fragment
-        assert(uint64_t(sz)==sha1.usize());
-        memcpy(sha1result, sha1.result(), 20);
         htptr=htinv.find(sha1result);
       }  // end if fi<vf.size()
 
@@ -2493,6 +4563,11 @@ int Jidac::add() {
         // Pad sb with fragment size list, then compress
         if (newblock) {
           assert(frags>0);
+          if (command=='e') {
+            bx.push_back(total_done-sz-bdone);
+            bd.push_back(sb.size());
+            bdone=total_done-sz;
+          }
           assert(frags<ht.size());
           for (unsigned i=ht.size()-frags; i<ht.size(); ++i)
             puti(sb, ht[i].usize, 4);  // list of frag sizes
@@ -2508,8 +4583,13 @@ int Jidac::add() {
             printf("[%u..%u] %u -method %s\n",
                 unsigned(ht.size())-frags, unsigned(ht.size())-1,
                 unsigned(sb.size()), m.c_str());
-          if (method[0]!='i')
-            job.write(sb, fn.c_str(), m.c_str());
+          if (method[0]!='i') {
+            string sha1s;
+            if (verify)
+              for (unsigned i=ht.size()-frags; i<ht.size(); ++i)
+                sha1s.append((const char*)ht[i].sha1, 20);
+            job.write(sb, fn.c_str(), m.c_str(), 0, sha1s);
+          }
           else {  // index: don't compress data
             job.csize.push_back(sb.size());
             sb.resize(0);
@@ -2543,13 +4623,18 @@ int Jidac::add() {
         }
         vf[fi]->second.ptr.push_back(htptr);
       }
-      if (c==EOF) break;
+      if (eof && ri+2<ranges.size()) {  // next sampled part
+        ri+=2;
+        fr.range(ranges[ri], ranges[ri+1]);
+        eof=false;
+      }
+      if (eof) break;
     }  // end for each fragment fj
     if (fi<vf.size()) {
       dedupesize+=fsize;
       DTMap::iterator p=vf[fi];
       print_progress(total_size, total_done, summary);
-      if (summary<=0) {
+      if (summary<=0 && command!='e') {
         string newname=rename(p->first.c_str());
         DTMap::iterator a=dt.find(newname);
         if (a==dt.end() || a->second.date==0) printf("+ ");
@@ -2564,27 +4649,136 @@ int Jidac::add() {
         printf("\n");
       }
       assert(in!=FPNULL);
-      fclose(in);
+      if (tar) {  // if truncated, don't index it. nextTar() reports it.
+        tarin.skip-=p->second.size-fr.untaken();
+        if (fr.untaken()) p->second.date=0;
+        tarptr[p->first]=p->second.ptr;
+      }
+      else fclose(in);
       in=FPNULL;
+      if (hashcache.on() && command!='e') {  // save hash of whole file
+        p->second.hash[0]=1;
+        memcpy(p->second.hash+1, fhash.result(), 20);
+        if (!tar) hashcache.put(p->first, fstamp, p->second.hash+1);
+      }
     }
   }  // end for each file fi
+
+  // Save the index of the batch and get the next one
+  if (command!='e') indexFiles(ib, added);
+  if (runs.size()) {
+    if (!ibf) ibf=tmpfile();
+    if (!ibf) ioerr("tmpfile");
+    if (fwrite(ib.c_str(), 1, ib.size(), ibf)!=ib.size()) ioerr("tmpfile");
+    ib.reset();
+  }
+  if (lastbatch) break;
+  if (tar) {
+    lastbatch=nextTar();
+    total_size+=sortFiles(vf);
+    total_files+=vf.size();
+  }
+  else {
+    lastbatch=nextBatch();
+    sortFiles(vf);
+  }
+  }  // end for each batch
   assert(sb.size()==0);
+  if (tar && tarfile) fclose(tarin.f);
+  if (tar && tarin.err) ++errors;
 
   // Wait for jobs to finish
   job.write(sb, 0, "");  // signal end of input
   for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
   join(wid);
+  for (unsigned i=0; i<vid.size(); ++i) join(vid[i]);
+  if (!pool) idleCores.add(-threads);
+  if (job.verrors) error("verify failed, archive not updated");
+
+  // Estimate: extrapolate from the sampled blocks to all input
+  if (command=='e') {
+    assert(bx.size()==job.csize.size());
+    vector<double> bc(job.csize.begin(), job.csize.end());
+    const double f=total_size>0 ? double(total_done)/total_size : 1;
+    const double secs=(mtime()-start)*0.001;
+    double dci=0, cci=0;
+    const double dr=ratioEstimate(bx, bd, f, dci);
+    const double cr=ratioEstimate(bx, bc, f, cci);
+    printf("Sampled %1.6f of %1.6f MB (%1.2f%%) in %d of %d files,"
+        " %d blocks.\n", total_done/1000000.0, total_size/1000000.0, f*100,
+        sampled, int(total_files), int(bx.size()));
+    printf("After dedupe: %1.6f MB", dr*total_size/1000000.0);
+    if (dci>=0) printf(" +- %1.6f", dci*total_size/1000000.0);
+    printf(" (%1.2f%%)\n", dr*100);
+    printf("Compressed:   %1.6f MB", cr*total_size/1000000.0);
+    if (cci>=0) printf(" +- %1.6f", cci*total_size/1000000.0);
+    printf(" (%1.2f%%)\n", cr*100);
+    if (secs>0 && total_done>0)
+      printf("Time:         %1.1f sec at %1.3f MB/s\n",
+          secs/f, total_done/1000000.0/secs);
+    if (ibf) fclose(ibf);
+    return errors>0;
+  }
+
+  // Commit a -concurrent update. Holding the lock, read the archive again
+  // to find its end, the next fragment ID, and the last date, which other
+  // writers may have changed. New fragments from htsize are renumbered
+  // from firstid, and the staged D blocks are appended with new names.
+  ArchiveLock alock(concurrent ? archive.c_str() : 0);
+  OutputArchive* arc=&out;  // archive to append to
+  unsigned firstid=htsize;  // ID of the first new fragment in the archive
+  if (concurrent) {
+    vector<HT> ht0;
+    DTMap dt0;
+    vector<VER> ver0;
+    vector<Block> block0;
+    ht.swap(ht0), dt.swap(dt0), ver.swap(ver0), block.swap(block0);
+    ht.resize(1);
+    ver.resize(1);
+    header_pos=32*(password!=0);
+    if (storage->size(archive)>=0) {
+      header_pos=read_archive(archive.c_str());
+      if (password && storage->read(archive, 0, salt, 32)!=32)
+        error("cannot read salt");
+    }
+    firstid=ht.size();
+    const int64_t lastdate=ver.back().lastdate;
+    ht.swap(ht0), dt.swap(dt0), ver.swap(ver0), block.swap(block0);
+    if (firstid<htsize) error("archive was truncated by another writer");
+    if (lastdate>=date) {
+      date=decimal_time(unix_time(lastdate)+1);
+      printf("Committing as of %s\n", dateToString(date).c_str());
+    }
+    arc=new OutputArchive(archive.c_str(), password, salt, 0);
+    arc->seek(header_pos, SEEK_SET);
+    writeJidacHeader(arc, date, -1, firstid);
+    header_end=arc->tell();
+    assert(blocklist.size()==job.csize.size());
+    StringBuffer b;
+    fflush(stage.f);
+    rewind(stage.f);
+    for (unsigned i=0; i<job.csize.size(); ++i) {
+      b.resize(0);
+      b.write(0, job.csize[i]);
+      if (fread(b.data(), 1, b.size(), stage.f)!=b.size()) ioerr("tmpfile");
+      if (!renameBlock((char*)b.data(), b.size(),
+          "jDC"+itos(stagedate, 14)+"d"+itos(blocklist[i], 10),
+          "jDC"+itos(date, 14)+"d"+itos(blocklist[i]-htsize+firstid, 10)))
+        error("staged block is damaged");
+      arc->write(b.c_str(), b.size());
+    }
+  }
 
   // Open index
   salt[0]^='7'^'z';
   OutputArchive outi(index ? index : "", password, salt, 0);
   WriterPair wp;
-  wp.a=&out;
+  wp.a=arc;
   if (index) wp.b=&outi;
   writeJidacHeader(&outi, date, 0, htsize);
 
   // Append compressed fragment tables to archive
-  int64_t cdatasize=out.tell()-header_end;
+  int64_t cdatasize=arc->tell()-header_end;
   StringBuffer is;
   assert(blocklist.size()==job.csize.size());
   blocklist.push_back(ht.size());
@@ -2596,17 +4790,19 @@ int Jidac::add() {
         puti(is, ht[j].usize, 4);
       }
       libzpaq::compressBlock(&is, &wp, "0",
-          ("jDC"+itos(date, 14)+"h"+itos(blocklist[i], 10)).c_str(),
-          "jDC\x01");
+          ("jDC"+itos(date, 14)+"h"+itos(blocklist[i]-htsize+firstid, 10))
+          .c_str(), "jDC\x01");
       is.resize(0);
     }
   }
 
-  // Delete from archive
+  // Delete from archive. With -tar, only files... select what to delete,
+  // so that tars from different sources can be added to one archive.
   int dtcount=0;  // index block header name
   int removed=0;  // count
-  for (DTMap::iterator p=dt.begin(); p!=dt.end(); ++p) {
-    if (p->second.date && !p->second.data) {
+  const bool deleting=!tar || files.size()>0;
+  for (DTMap::iterator p=dt.begin();; ++p) {
+    if (p!=dt.end() && deleting && p->second.date && !p->second.data) {
       puti(is, 0, 8);
       is.write(p->first.c_str(), strlen(p->first.c_str()));
       is.put(0);
@@ -2616,90 +4812,68 @@ int Jidac::add() {
         printf("\n");
       }
       ++removed;
-      if (is.size()>16000) {
-        libzpaq::compressBlock(&is, &wp, "1",
-            ("jDC"+itos(date)+"i"+itos(++dtcount, 10)).c_str(), "jDC\x01");
-        is.resize(0);
-      }
     }
+    if (is.size()>16000 || (is.size()>0 && p==dt.end())) {
+      libzpaq::compressBlock(&is, &wp, "1",
+          ("jDC"+itos(date)+"i"+itos(++dtcount, 10)).c_str(), "jDC\x01");
+      is.resize(0);
+    }
+    if (p==dt.end()) break;
   }
 
-  // Append compressed index to archive
-  int added=0;  // count
-  for (DTMap::iterator p=edt.begin();; ++p) {
-    if (p!=edt.end()) {
-      string filename=rename(p->first);
-      DTMap::iterator a=dt.find(filename);
-      if (p->second.date && (a==dt.end() // new file
-         || a->second.date!=p->second.date  // date change
-         || (a->second.attr && a->second.attr!=p->second.attr)  // attr ch.
-         || a->second.size!=p->second.size  // size change
-         || (p->second.data && a->second.ptr!=p->second.ptr))) { // content
-        if (summary<=0 && p->second.data==0) {  // not compressed?
-          if (a==dt.end() || a->second.date==0) printf("+ ");
-          else printf("# ");
-          printUTF8(p->first.c_str());
-          if (filename!=p->first) {
-            printf(" -> ");
-            printUTF8(filename.c_str());
-          }
-          printf("\n");
-        }
-        ++added;
-        puti(is, p->second.date, 8);
-        is.write(filename.c_str(), strlen(filename.c_str()));
-        is.put(0);
-        if ((p->second.attr&255)=='u') {  // unix attributes
-          puti(is, 3, 4);
-          puti(is, p->second.attr, 3);
-        }
-        else if ((p->second.attr&255)=='w') {  // windows attributes
-          puti(is, 5, 4);
-          puti(is, p->second.attr, 5);
-        }
-        else puti(is, 0, 4);  // no attributes
-        if (a==dt.end() || p->second.data) a=p;  // use new frag pointers
-        puti(is, a->second.ptr.size(), 4);  // list of frag pointers
-        for (unsigned i=0; i<a->second.ptr.size(); ++i)
-          puti(is, a->second.ptr[i], 4);
-      }
+  // Append compressed index of added files to archive
+  if (ibf) rewind(ibf);
+  for (const char* s=ib.c_str();;) {
+    char buf[4];
+    unsigned n=0;
+    if (ibf) {
+      if (fread(buf, 1, 4, ibf)!=4) break;
+      const char* b=buf;
+      n=btoi(b);
+      is.write(0, n);
+      if (fread(is.data(), 1, n, ibf)!=n) ioerr("tmpfile");
     }
-    if (is.size()>16000 || (is.size()>0 && p==edt.end())) {
-      libzpaq::compressBlock(&is, &wp, "1",
-          ("jDC"+itos(date)+"i"+itos(++dtcount, 10)).c_str(), "jDC\x01");
-      is.resize(0);
+    else {
+      if (s>=ib.c_str()+ib.size()) break;
+      n=btoi(s);
+      is.write(s, n);
+      s+=n;
     }
-    if (p==edt.end()) break;
+    if (firstid!=htsize) renumber(is, htsize, firstid-htsize);
+    libzpaq::compressBlock(&is, &wp, "1",
+        ("jDC"+itos(date)+"i"+itos(++dtcount, 10)).c_str(), "jDC\x01");
+    is.resize(0);
   }
+  if (ibf) fclose(ibf);
   printf("%d +added, %d -removed.\n", added, removed);
   assert(is.size()==0);
 
   // Back up and write the header
   outi.close();
-  int64_t archive_end=out.tell();
-  out.seek(header_pos, SEEK_SET);
-  writeJidacHeader(&out, date, cdatasize, htsize);
-  out.seek(0, SEEK_END);
-  int64_t archive_size=out.tell();
-  out.close();
-
-  // Truncate empty update from archive (if not indexed)
+  int64_t archive_end=arc->tell();
+  arc->seek(header_pos, SEEK_SET);
+  writeJidacHeader(arc, date, cdatasize, firstid);
+  arc->seek(0, SEEK_END);
+  int64_t archive_size=arc->tell();
+
+  // Truncate empty update from archive (if not indexed) before it is
+  // committed to storage
   if (!index) {
     if (added+removed==0 && archive_end-header_pos==104) // no update
       archive_end=header_pos;
-    if (archive_end<archive_size) {
-      if (archive_end>0) {
-        printf("truncating archive from %1.0f to %1.0f\n",
-            double(archive_size), double(archive_end));
-        if (truncate(arcname.c_str(), archive_end)) printerr(archive.c_str());
-      }
-      else if (archive_end==0) {
-        if (delete_file(arcname.c_str())) {
-          printf("deleted ");
-          printUTF8(arcname.c_str());
-          printf("\n");
-        }
-      }
+    if (archive_end<archive_size && archive_end>0) {
+      printf("truncating archive from %1.0f to %1.0f\n",
+          double(archive_size), double(archive_end));
+      if (!arc->truncate(archive_end)) printerr(archive.c_str());
+    }
+  }
+  arc->close();
+  if (arc!=&out) delete arc;
+  if (!index && archive_end<archive_size && archive_end==0) {
+    if (storage->remove(arcname)) {
+      printf("deleted ");
+      printUTF8(arcname.c_str());
+      printf("\n");
     }
   }
   fflush(stdout);
@@ -2709,6 +4883,151 @@ int Jidac::add() {
   return errors>0;
 }
 
+////////////////////////////// batch //////////////////////////////////
+
+// A batch command runs a list of add jobs, one per line of a job file,
+// in one process. Each job has its own Jidac but all share a BatchPool,
+// so blocks from all jobs compete for -threads compressors and -memory.
+// Up to -threads jobs run at once, each in its own batchThread.
+
+// Jobs of a batch and their results
+struct BatchJob {
+  vector<vector<string> > args;  // arguments after "add" of each job
+  vector<int> result;    // return code of each job
+  unsigned next;         // index of next job to start
+  Mutex mutex;           // protects next
+  BatchPool pool;        // shared by all jobs
+  BatchJob(int threads, int mb): next(0), pool(threads, mb) {
+    init_mutex(mutex);
+  }
+  ~BatchJob() {destroy_mutex(mutex);}
+};
+
+// Run jobs until none are left
+ThreadReturn batchThread(void* arg) {
+  BatchJob& job=*(BatchJob*)arg;
+  while (true) {
+    lock(job.mutex);
+    const unsigned i=job.next++;
+    release(job.mutex);
+    if (i>=job.args.size()) break;
+    vector<const char*> argv;
+    argv.push_back("zpaq");
+    argv.push_back("add");
+    for (unsigned j=0; j<job.args[i].size(); ++j)
+      argv.push_back(job.args[i][j].c_str());
+    printf("Job %u/%u: add", i+1, unsigned(job.args.size()));
+    for (unsigned j=2; j<argv.size(); ++j) {
+      printf(" ");
+      printUTF8(argv[j]);
+    }
+    printf("\n");
+    int r=1;
+    try {
+      Jidac jidac;
+      jidac.pool=&job.pool;
+      r=jidac.doCommand(argv.size(), &argv[0]);
+    }
+    catch (std::exception& e) {
+      fflush(stdout);
+      fprintf(stderr, "Job %u: %s\n", i+1, e.what());
+    }
+    job.result[i]=r;
+    printf("Job %u/%u %s\n", i+1, unsigned(job.args.size()),
+        r ? "failed" : "done");
+  }
+  return 0;
+}
+
+// Read the job file named by archive and run its jobs. Each line is
+// the arguments to add: archive files... -options... Arguments are
+// separated by spaces, and may be quoted with "". Blank lines and
+// lines starting with # are skipped. Return 1 if any job failed.
+int Jidac::batch() {
+
+  // Read the job file
+  FP in=fopen(archive.c_str(), RB);
+  if (in==FPNULL) ioerr(archive.c_str());
+  string s;
+  char buf[4096];
+  for (int n; (n=fread(buf, 1, sizeof(buf), in))>0;) s.append(buf, n);
+  fclose(in);
+
+  // Split into lines of arguments
+  vector<vector<string> > jobs;
+  vector<string> line;
+  string arg;
+  bool quoted=false, inarg=false;
+  for (unsigned i=0; i<=s.size(); ++i) {
+    const int c=i<s.size() ? (s[i]&255) : '\n';
+    if (c=='"') quoted=!quoted, inarg=true;
+    else if (c>' ' || (quoted && c!='\n' && c!='\r')) arg+=char(c), inarg=true;
+    else {
+      if (inarg) line.push_back(arg), arg="", inarg=false;
+      if (c=='\n') {
+        if (line.size()>0 && line[0][0]!='#') jobs.push_back(line);
+        line.clear();
+        quoted=false;
+      }
+    }
+  }
+
+  // Check that each job is an add that can share the process
+  for (unsigned i=0; i<jobs.size(); ++i) {
+    const vector<string>& a=jobs[i];
+    const char* why=0;
+    if (a[0][0]=='-') why="archive expected";
+    else if ((a.size()<2 || a[1][0]=='-')
+        && find(a.begin(), a.end(), "-tar")==a.end())
+      why="no files to add";
+    for (unsigned j=1; j<a.size(); ++j) {
+      if (a[j]=="-stdout" || a[j]=="-storage" || a[j]=="-stripe")
+        why=a[j]=="-stdout" ? "-stdout not allowed in a job"
+            : "give -storage or -stripe to batch, not to a job";
+      if (a[j]=="-tar" && (j+1==a.size() || a[j+1][0]=='-'))
+        why="-tar needs a file in a job";
+    }
+    if (why) {
+      fflush(stdout);
+      fprintf(stderr, "Job %u: %s:", i+1, why);
+      for (unsigned j=0; j<a.size(); ++j)
+        fprintf(stderr, " %s", a[j].c_str());
+      fprintf(stderr, "\n");
+      error("bad job file");
+    }
+  }
+  if (jobs.size()==0) {
+    printf("No jobs in %s\n", archive.c_str());
+    return 0;
+  }
+
+  // Run up to -threads jobs at once
+  BatchJob job(threads, int(memory/1000000));
+  job.args.swap(jobs);
+  job.result.resize(job.args.size(), 1);
+  vector<ThreadID> tid(min(unsigned(threads), unsigned(job.args.size())));
+  printf("Running %u jobs, up to %u at once, -threads %d",
+      unsigned(job.args.size()), unsigned(tid.size()), threads);
+  if (memory>0) printf(" -memory %1.0f", memory/1e6);
+  printf("\n");
+  idleCores.add(threads);
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], batchThread, &job);
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  idleCores.add(-threads);
+
+  // Report failed jobs
+  int failed=0;
+  for (unsigned i=0; i<job.result.size(); ++i) {
+    if (job.result[i]) {
+      if (++failed==1) printf("Failed jobs:");
+      printf(" %u", i+1);
+    }
+  }
+  if (failed) printf("\n");
+  printf("%d of %u jobs failed\n", failed, unsigned(job.result.size()));
+  return failed>0;
+}
+
 /////////////////////////////// extract ///////////////////////////////
 
 // Return true if the internal file p
@@ -2741,6 +5060,13 @@ bool Jidac::equal(DTMap::const_iterator p, const char* filename) {
   fseeko(in, 0, SEEK_END);
   if (ftello(in)!=p->second.size) return fclose(in), false;
 
+  // compare the whole file hash, saved by -hashcache if possible
+  char h[20];
+  if (p->second.hash[0] && hashcache.on()) {
+    fclose(in);
+    return hashFile(filename, h) && !memcmp(h, p->second.hash+1, 20);
+  }
+
   // compare hashes
   fseeko(in, 0, SEEK_SET);
   libzpaq::SHA1 sha1;
@@ -2764,6 +5090,25 @@ bool Jidac::equal(DTMap::const_iterator p, const char* filename) {
   return true;
 }
 
+// Set hash[0..19] to the SHA-1 of the contents of external file filename,
+// from -hashcache if it has not changed since, else by reading it and
+// saving it there. Return false if it cannot be read.
+bool Jidac::hashFile(const string& filename, char* hash) {
+  if (hashcache.find(filename, hash)) return true;
+  string s;
+  if (HashCache::stamp(filename, s)<0) return false;
+  FP in=fopen(filename.c_str(), RB);
+  if (in==FPNULL) return false;
+  libzpaq::SHA1 sha1;
+  libzpaq::Array<char> buf(1<<16);
+  int n;
+  while ((n=fread(&buf[0], 1, buf.size(), in))>0) sha1.write(&buf[0], n);
+  fclose(in);
+  memcpy(hash, sha1.result(), 20);
+  hashcache.put(filename, s, hash);
+  return true;
+}
+
 // An extract job is a set of blocks with at least one file pointing to them.
 // Blocks are extracted in separate threads, set READY -> WORKING.
 // A block is extracted to memory up to the last fragment that has a file
@@ -2932,9 +5277,16 @@ ThreadReturn decompressThread(void* arg) {
           || p->second.data>=int64_t(p->second.ptr.size()))
         continue;  // don't write
 
-      // Look for pointers to this block
+      // Look for pointers to this block. With -range, ptr was trimmed
+      // and only output offsets 0..limit-1 are written.
       const vector<unsigned>& ptr=p->second.ptr;
       int64_t offset=0;  // write offset
+      int64_t limit=-1;  // -range size or -1 if none
+      if (job.jd.rangestart>=0) {
+        map<string, int64_t>::iterator r=job.jd.rangeskip.find(p->first);
+        if (r!=job.jd.rangeskip.end()) offset=-r->second;
+        limit=job.jd.rangesize;
+      }
       for (unsigned j=0; j<ptr.size(); ++j) {
         if (ptr[j]<b.start || ptr[j]>=b.start+b.extracted) {
           offset+=job.jd.ht[ptr[j]].usize;
@@ -3025,12 +5377,15 @@ ThreadReturn decompressThread(void* arg) {
         assert(q+usize<=out.size());
 
         // Write the merged fragment unless they are all zeros and it
-        // does not include the last fragment.
-        uint64_t nz=q;  // first nonzero byte in fragments to be written
-        while (nz<q+usize && out.c_str()[nz]==0) ++nz;
-        if (!job.jd.dotest && (nz<q+usize || j+1==ptr.size())) {
-          fseeko(job.outf, offset, SEEK_SET);
-          fwrite(out.c_str()+q, 1, usize, job.outf);
+        // does not include the last fragment. Clip to -range.
+        int64_t lo=0, hi=usize;  // part of merged fragment to write
+        if (offset<0) lo=min(-offset, hi);
+        if (limit>=0 && offset+hi>limit) hi=max(lo, limit-offset);
+        uint64_t nz=q+lo;  // first nonzero byte in fragments to be written
+        while (nz<q+hi && out.c_str()[nz]==0) ++nz;
+        if (!job.jd.dotest && (nz<q+hi || j+1==ptr.size())) {
+          fseeko(job.outf, offset+lo, SEEK_SET);
+          fwrite(out.c_str()+q+lo, 1, hi-lo, job.outf);
         }
         offset+=usize;
         lock(job.mutex);
@@ -3049,8 +5404,9 @@ ThreadReturn decompressThread(void* arg) {
             int64_t attr=p->second.attr;
             int64_t date=p->second.date;
             if ((p->second.attr&0x1ff)=='w'+256) attr=0;  // read-only?
-            if (p->second.data!=int64_t(p->second.ptr.size()))
-              date=attr=0;  // not last frag
+            if (p->second.data!=int64_t(p->second.ptr.size())
+                || job.jd.rangestart>=0)
+              date=attr=0;  // not last frag or part of file
             close(fn.c_str(), date, attr, job.outf);
             job.outf=FPNULL;
           }
@@ -3067,17 +5423,538 @@ ThreadReturn decompressThread(void* arg) {
   return 0;
 }
 
-// Streaming output destination
-struct OutputFile: public libzpaq::Writer {
-  FP f;
-  void put(int c) {
-    char ch=c;
-    if (f!=FPNULL) fwrite(&ch, 1, 1, f);
+// Streaming blocks are independent, so they are decompressed in parallel
+// by streamThreads into a window of buffers and then written to files
+// in block order by the main thread. A streamThread waits for a free
+// buffer before taking the next block, so that at most qsize blocks
+// are held in memory.
+
+// A decompressed streaming block
+struct SJ {
+  StringBuffer out;          // decompressed segments
+  vector<unsigned> sizes;    // size of each segment in out
+  vector<bool> named;        // segment has a filename (starts a file)
+  string err;                // why the rest of the block failed or ""
+  Semaphore done;            // 1 when decompressed
+};
+
+// Streaming blocks to extract
+struct StreamJob {
+  Mutex mutex;               // protects next
+  Jidac& jd;                 // what to extract
+  vector<unsigned> blocks;   // indexes of streaming blocks in jd.block
+  unsigned next;             // next element of blocks to decompress
+  SJ* q;                     // blocks[i] is decompressed in q[i%qsize]
+  unsigned qsize;            // number of buffers
+  Semaphore slots;           // number of free buffers
+  StreamJob(Jidac& j, unsigned n): jd(j), next(0), q(0), qsize(n) {
+    q=new SJ[n];
+    init_mutex(mutex);
+    slots.init(n);
+    for (unsigned i=0; i<n; ++i) q[i].done.init(0);
+  }
+  ~StreamJob() {
+    for (unsigned i=0; i<qsize; ++i) q[i].done.destroy();
+    slots.destroy();
+    destroy_mutex(mutex);
+    delete[] q;
   }
-  void write(const char* buf, int n) {if (f!=FPNULL) fwrite(buf, 1, n, f);}
-  OutputFile(FP out=FPNULL): f(out) {}
 };
 
+// Decompress streaming blocks and verify checksums until none are left
+ThreadReturn streamThread(void* arg) {
+  StreamJob& job=*(StreamJob*)arg;
+  InputArchive in(job.jd.archive.c_str(), job.jd.password);
+  while (true) {
+    job.slots.wait();
+    lock(job.mutex);
+    const unsigned n=job.next;
+    if (n<job.blocks.size()) ++job.next;
+    release(job.mutex);
+    if (n>=job.blocks.size()) {
+      job.slots.signal();  // let other threads quit
+      return 0;
+    }
+    Block& b=job.jd.block[job.blocks[n]];
+    SJ& sj=job.q[n%job.qsize];
+    sj.out.resize(0);
+    sj.sizes.clear();
+    sj.named.clear();
+    sj.err="";
+    try {
+      if (!in.isopen()) error("archive not open");
+      in.seek(b.offset, SEEK_SET);
+      libzpaq::Decompresser d;
+      d.setInput(&in);
+      if (!d.findBlock()) error("block not found");
+      StringWriter filename;
+      for (unsigned j=0; j<b.size; ++j) {
+        if (!d.findFilename(&filename)) error("segment not found");
+        d.readComment();
+
+        // Decompress segment
+        libzpaq::SHA1 sha1;
+        d.setSHA1(&sha1);
+        const size_t start=sj.out.size();
+        d.setOutput(&sj.out);
+        d.decompress();
+
+        // Verify checksum
+        char sha1result[21];
+        d.readSegmentEnd(sha1result);
+        if (sha1result[0]==1) {
+          if (memcmp(sha1result+1, sha1.result(), 20)!=0)
+            error("checksum failed");
+        }
+        else if (sha1result[0]!=0)
+          error("unknown checksum type");
+        sj.sizes.push_back(sj.out.size()-start);
+        sj.named.push_back(filename.s!="");
+        filename.s="";
+      }
+    }
+    catch (std::exception& e) {
+      sj.err=e.what();
+    }
+    sj.done.signal();
+  }
+  return 0;
+}
+
+/////////////////////////////// tar ///////////////////////////////////
+
+// With extract -tar, files are written as a POSIX pax archive in the
+// same order as -stdout, each preceded by a header and padded to a
+// multiple of 512 bytes. Files whose fragment lists are identical to an
+// earlier file are stored as hard links to it.
+
+// Return filename as a relative tar member name
+string tarName(string fn) {
+  if (fn.size()>1 && fn[1]==':') fn=fn.substr(2);  // drive letter
+  while (fn!="" && fn[0]=='/') fn=fn.substr(1);
+  return fn;
+}
+
+// Return unix permissions for zpaq attributes attr
+int64_t tarMode(int64_t attr, bool isdir) {
+  if ((attr&255)=='u') return attr>>8&07777;
+  int64_t mode=isdir ? 0755 : 0644;
+  if ((attr&255)=='w' && (attr>>8&1)) mode&=0555;  // read-only
+  return mode;
+}
+
+// Write x in octal as n-1 digits and a NUL at s
+void putoct(char* s, int n, int64_t x) {
+  s[--n]=0;
+  while (n--) s[n]='0'+(x&7), x>>=3;
+}
+
+// Return a pax extended header record "length key=value\n"
+string paxRecord(const string& key, const string& value) {
+  const string r=" "+key+"="+value+"\n";
+  int64_t n=r.size()+1;  // length including its own digits
+  while (int64_t(itos(n).size()+r.size())!=n) n=itos(n).size()+r.size();
+  return itos(n)+r;
+}
+
+// Append to s a 512 byte ustar header for a member of the given type
+// ('0' = file, '1' = hard link, '5' = directory, 'x' = pax). If the
+// name, link or size does not fit then put them in a pax header first.
+void tarHeader(string& s, string name, char type, int64_t size,
+               int64_t mode, int64_t mtime, const string& link="") {
+
+  // Split a long name into prefix and name at a / if possible
+  string prefix;
+  if (name.size()>100) {
+    size_t i=name.find('/', name.size()-101);
+    if (i!=string::npos && i>0 && i<=155 && i+1<name.size())
+      prefix=name.substr(0, i), name=name.substr(i+1);
+  }
+
+  // Write pax records for fields that don't fit
+  if (type!='x') {
+    string pax;
+    const int64_t MAXOCT=077777777777LL;  // 11 octal digits
+    if (name.size()>100) pax+=paxRecord("path", prefix+name);
+    if (link.size()>100) pax+=paxRecord("linkpath", link);
+    if (size>MAXOCT) pax+=paxRecord("size", itos(size));
+    if (mtime<0 || mtime>MAXOCT) pax+=paxRecord("mtime", itos(mtime));
+    if (pax!="") {
+      tarHeader(s, "PaxHeader/"+name.substr(0, 90), 'x', pax.size(), 0644,
+                mtime>0 && mtime<=MAXOCT ? mtime : 0);
+      s+=pax;
+      s.append((512-pax.size()%512)%512, '\0');
+    }
+    if (size>MAXOCT) size=0;
+    if (mtime<0 || mtime>MAXOCT) mtime=0;
+  }
+
+  // Write header with checksum of spaces, then fill it in
+  char h[512]={0};
+  memcpy(h, name.c_str(), min(name.size(), size_t(100)));
+  putoct(h+100, 8, mode&07777);
+  putoct(h+108, 8, 0);  // uid
+  putoct(h+116, 8, 0);  // gid
+  putoct(h+124, 12, size);
+  putoct(h+136, 12, mtime);
+  memset(h+148, ' ', 8);
+  h[156]=type;
+  memcpy(h+157, link.c_str(), min(link.size(), size_t(100)));
+  memcpy(h+257, "ustar\0" "00", 8);
+  memcpy(h+345, prefix.c_str(), min(prefix.size(), size_t(155)));
+  unsigned sum=0;
+  for (int i=0; i<512; ++i) sum+=h[i]&255;
+  putoct(h+148, 7, sum);
+  s.append(h, 512);
+}
+
+/////////////////////////// extract -stdout ////////////////////////////
+
+// With -stdout, the selected files are written to standard output one
+// after another in filename order. The output is cut into pieces, each a
+// run of consecutive fragments of one file in one block, and each piece
+// is assigned a task that decompresses its block. A piece shares the
+// latest task for its block if that task is one of the last qsize, so
+// that a block is decompressed again only if it is needed again much
+// later. Tasks are decompressed in order by stdoutThreads into a ring of
+// qsize buffers. The main thread writes the pieces in order as soon as
+// their tasks are done, and frees the buffers in task order as their last
+// pieces are written, so at most qsize blocks are held at once.
+
+// A run of fragments to write
+struct Piece {
+  unsigned task;        // index in tasks of the block to decompress
+  unsigned frag;        // first fragment ID
+  unsigned n;           // number of fragments
+  int64_t skip;         // bytes to skip at start of run (-range)
+  int64_t size;         // bytes to write, -1 = all (streaming)
+};
+
+// A block to decompress
+struct Task {
+  unsigned block;       // index in jd.block
+  unsigned frags;       // number of fragments to decompress
+  unsigned last;        // index of last piece in this block
+};
+
+// A decompressed task
+struct ST {
+  StringBuffer out;     // decompressed fragments
+  vector<uint64_t> off; // offset of each fragment in out, then end
+  string err;           // why decompression failed or ""
+  Semaphore done;       // 1 when decompressed
+};
+
+// Pieces to write to stdout
+struct StdoutJob {
+  Mutex mutex;          // protects next
+  Jidac& jd;            // what to extract
+  vector<Piece> pieces; // output in order
+  vector<Task> tasks;   // blocks to decompress in order of first use
+  unsigned next;        // next element of tasks to decompress
+  ST* q;                // tasks[i] is decompressed in q[i%qsize]
+  unsigned qsize;       // number of buffers
+  Semaphore slots;      // number of free buffers
+  StdoutJob(Jidac& j, unsigned n): jd(j), next(0), q(0), qsize(n) {
+    q=new ST[n];
+    init_mutex(mutex);
+    slots.init(n);
+    for (unsigned i=0; i<n; ++i) q[i].done.init(0);
+  }
+  ~StdoutJob() {
+    for (unsigned i=0; i<qsize; ++i) q[i].done.destroy();
+    slots.destroy();
+    destroy_mutex(mutex);
+    delete[] q;
+  }
+};
+
+// Decompress tasks and verify checksums until none are left
+ThreadReturn stdoutThread(void* arg) {
+  StdoutJob& job=*(StdoutJob*)arg;
+  InputArchive in(job.jd.archive.c_str(), job.jd.password);
+  while (true) {
+    job.slots.wait();
+    lock(job.mutex);
+    const unsigned n=job.next;
+    if (n<job.tasks.size()) ++job.next;
+    release(job.mutex);
+    if (n>=job.tasks.size()) {
+      job.slots.signal();  // let other threads quit
+      return 0;
+    }
+    const Task& t=job.tasks[n];
+    const Block& b=job.jd.block[t.block];
+    ST& st=job.q[n%job.qsize];
+    st.out.reset();
+    st.off.assign(1, 0);
+    st.err="";
+    try {
+      if (!in.isopen()) error("archive not open");
+      in.seek(b.offset, SEEK_SET);
+      libzpaq::Decompresser d;
+      d.setInput(&in);
+      d.setOutput(&st.out);
+      if (!d.findBlock()) error("archive block not found");
+
+      // Journaling block: fragment sizes are known. Decompress
+      // up to the last fragment needed and verify each one.
+      if (b.usize>=0) {
+        for (unsigned j=0; j<t.frags; ++j)
+          st.off.push_back(st.off.back()+job.jd.ht[b.start+j].usize);
+        const uint64_t usize=st.off.back();
+        st.out.setLimit(b.usize);
+        while (st.out.size()<usize && d.findFilename()) {
+          d.readComment();
+          while (st.out.size()<usize && d.decompress(1<<14));
+          if (st.out.size()<usize) d.readSegmentEnd();
+        }
+        if (st.out.size()<usize) error("unexpected end of compressed data");
+        for (unsigned j=0; j<t.frags; ++j) {
+          libzpaq::SHA1 sha1;
+          sha1.write(st.out.c_str()+st.off[j], st.off[j+1]-st.off[j]);
+          if (memcmp(sha1.result(), job.jd.ht[b.start+j].sha1, 20))
+            error("bad checksum");
+        }
+      }
+
+      // Streaming block: each fragment is a segment
+      else {
+        st.out.setLimit(size_t(-1));
+        for (unsigned j=0; j<t.frags; ++j) {
+          if (!d.findFilename()) error("segment not found");
+          d.readComment();
+          libzpaq::SHA1 sha1;
+          d.setSHA1(&sha1);
+          d.decompress();
+          char sha1result[21];
+          d.readSegmentEnd(sha1result);
+          if (sha1result[0]==1) {
+            if (memcmp(sha1result+1, sha1.result(), 20)!=0)
+              error("checksum failed");
+          }
+          else if (sha1result[0]!=0)
+            error("unknown checksum type");
+          st.off.push_back(st.out.size());
+        }
+      }
+    }
+    catch (std::exception& e) {
+      st.err=e.what();
+    }
+    st.done.signal();
+  }
+  return 0;
+}
+
+// Return the index in block of the block containing fragment frag
+unsigned Jidac::findBlock(unsigned frag) {
+  assert(block.size()>0);
+  unsigned lo=0, hi=block.size()-1;
+  while (lo<hi) {
+    unsigned mid=(lo+hi+1)/2;
+    if (frag<block[mid].start) hi=mid-1;
+    else lo=mid;
+  }
+  return lo;
+}
+
+// Write s[0..n-1] to dataout unless -test. Return false if error.
+bool Jidac::writeOut(const char* s, size_t n) {
+  if (dotest || n==0 || fwrite(s, 1, n, dataout)==n) return true;
+  fflush(stdout);
+  fprintf(stderr, "Write failed\n");
+  return false;
+}
+
+// Write the files labeled for extraction with data=0 to dataout,
+// with -tar as a pax archive. Return 1 if error else 0.
+int Jidac::extractStdout() {
+
+  // Keep up to -memory of the largest block needed, else 2 per thread
+  unsigned qsize=threads*2;
+  int64_t maxusize=0;
+  for (unsigned i=0; i<block.size(); ++i)
+    if (block[i].size>0 && block[i].usize>maxusize)
+      maxusize=block[i].usize;
+  if (memory>0 && maxusize>0)
+    qsize=max(int64_t(1), min(int64_t(1<<16), memory/maxusize));
+
+  // List output files and their pieces and tasks
+  StdoutJob job(*this, qsize);
+  map<unsigned, unsigned> latest;  // block -> its last task
+  vector<DTMap::iterator> outfiles;  // in output order
+  vector<unsigned> first;  // index in pieces of first piece of outfiles[i]
+  vector<int> link;        // -tar: earlier outfiles index or -1
+  map<vector<unsigned>, int> same;  // -tar: fragment list -> first file
+  int64_t total_size=0;
+  for (DTMap::iterator p=dt.begin(); p!=dt.end(); ++p) {
+    if (p->second.data!=0 || !p->second.date || p->first=="") continue;
+    const bool isdir=p->first[p->first.size()-1]=='/';
+    if (isdir && (!tar || tarName(rename(p->first))=="")) continue;
+    if (tar && !isdir && p->second.size<0) {
+      fflush(stdout);
+      printUTF8(p->first.c_str(), stderr);
+      fprintf(stderr, ": -tar of streaming file, skipping...\n");
+      p->second.data=-1;  // skip
+      continue;
+    }
+    outfiles.push_back(p);
+    first.push_back(job.pieces.size());
+    link.push_back(-1);
+    const vector<unsigned>& ptr=p->second.ptr;
+    if (tar && !isdir && ptr.size()>0) {
+      map<vector<unsigned>, int>::iterator q=same.find(ptr);
+      if (q!=same.end()) {
+        link.back()=q->second;
+        continue;
+      }
+      same[ptr]=outfiles.size()-1;
+    }
+    int64_t offset=0;  // of ptr[i] in output file
+    if (rangestart>=0) offset=-rangeskip[p->first];
+    for (unsigned i=0; i<ptr.size();) {
+
+      // Find a run of fragments ptr[i..i+n-1] in block k
+      const unsigned k=findBlock(ptr[i]);
+      const unsigned end=k+1<block.size() ? block[k+1].start : ht.size();
+      Piece pc;
+      pc.frag=ptr[i];
+      pc.n=1;
+      pc.skip=0;
+      pc.size=ht[ptr[i]].usize;
+      while (i+pc.n<ptr.size() && ptr[i+pc.n]==ptr[i]+pc.n
+             && ptr[i+pc.n]<end) {
+        if (pc.size>=0 && ht[ptr[i+pc.n]].usize>=0)
+          pc.size+=ht[ptr[i+pc.n]].usize;
+        else pc.size=-1;
+        ++pc.n;
+      }
+      i+=pc.n;
+
+      // Clip to -range
+      if (pc.size>=0) {
+        const int64_t usize=pc.size;
+        int64_t hi=usize;
+        if (offset<0) pc.skip=min(-offset, usize);
+        if (rangesize>=0 && offset+hi>rangesize)
+          hi=max(pc.skip, rangesize-offset);
+        pc.size=hi-pc.skip;
+        offset+=usize;
+        if (pc.size==0) continue;
+      }
+      total_size+=max(pc.size, int64_t(0));
+
+      // Add a task or share a recent one
+      map<unsigned, unsigned>::iterator t=latest.find(k);
+      if (t==latest.end() || t->second+qsize<=job.tasks.size()) {
+        Task tk;
+        tk.block=k;
+        tk.frags=0;
+        latest[k]=job.tasks.size();
+        job.tasks.push_back(tk);
+      }
+      pc.task=latest[k];
+      Task& tk=job.tasks[pc.task];
+      tk.frags=max(tk.frags, pc.frag+pc.n-block[k].start);
+      tk.last=job.pieces.size();
+      job.pieces.push_back(pc);
+    }
+  }
+  first.push_back(job.pieces.size());
+  printf("Extracting %1.6f MB in %d files from %u blocks to %s"
+      " -threads %d\n", total_size/1000000.0, int(outfiles.size()),
+      unsigned(job.tasks.size()), tar ? "tar" : "stdout", threads);
+
+  // Decompress in parallel and write in order
+  vector<ThreadID> tid(job.tasks.size() ? threads : 0);
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], stdoutThread, &job);
+  unsigned waited=0, freed=0;  // tasks done and freed
+  int64_t written=0;
+  int errors=0;
+  string hdr;  // -tar header or padding
+  for (unsigned f=0; f<outfiles.size() && !errors; ++f) {
+    DTMap::iterator p=outfiles[f];
+
+    // Write tar header
+    int64_t size=0;  // -tar size of file
+    if (tar) {
+      const bool isdir=p->first[p->first.size()-1]=='/';
+      const int64_t mtime=unix_time(p->second.date);
+      const int64_t mode=tarMode(p->second.attr, isdir);
+      const string name=tarName(rename(p->first));
+      hdr="";
+      if (isdir) tarHeader(hdr, name, '5', 0, mode, mtime);
+      else if (link[f]>=0)
+        tarHeader(hdr, name, '1', 0, mode, mtime,
+                  tarName(rename(outfiles[link[f]]->first)));
+      else tarHeader(hdr, name, '0', size=p->second.size, mode, mtime);
+      if (!writeOut(hdr.c_str(), hdr.size())) errors=1;
+      if (summary<=0) {
+        printf("> ");
+        printUTF8(name.c_str());
+        printf("\n");
+      }
+    }
+
+    // Write pieces of the file as their blocks are decompressed
+    int64_t fsize=0;  // bytes of file written
+    for (unsigned i=first[f]; i<first[f+1] && !errors; ++i) {
+      const Piece& pc=job.pieces[i];
+      ST& st=job.q[pc.task%qsize];
+      if (pc.task==waited) st.done.wait(), ++waited;
+      assert(pc.task<waited);
+      const Block& b=block[job.tasks[pc.task].block];
+      if (st.err!="") {
+        fflush(stdout);
+        fprintf(stderr, "Block at %1.0f: %s\n", b.offset+0.0, st.err.c_str());
+        errors=1;
+        break;
+      }
+      const uint64_t start=st.off[pc.frag-b.start]+pc.skip;
+      const uint64_t end=pc.size<0 ? st.off[pc.frag-b.start+pc.n]
+                                   : start+pc.size;
+      assert(start<=end && end<=st.out.size());
+      if (!writeOut(st.out.c_str()+start, end-start)) errors=1;
+      fsize+=end-start;
+      while (freed<waited && job.tasks[freed].last<=i) {
+        job.q[freed%qsize].out.reset();
+        job.slots.signal();
+        ++freed;
+      }
+    }
+    written+=fsize;
+
+    // Pad tar member to a multiple of 512 bytes
+    if (tar && !errors) {
+      if (fsize!=size) {
+        fflush(stdout);
+        printUTF8(p->first.c_str(), stderr);
+        fprintf(stderr, ": size %1.0f is not %1.0f\n", fsize+0.0, size+0.0);
+        errors=1;
+      }
+      hdr.assign((512-size%512)%512, '\0');
+      if (!writeOut(hdr.c_str(), hdr.size())) errors=1;
+    }
+  }
+  if (tar && !errors) {  // end of archive
+    hdr.assign(1024, '\0');
+    if (!writeOut(hdr.c_str(), hdr.size())) errors=1;
+  }
+
+  // Stop threads early if there was an error
+  lock(job.mutex);
+  job.next=job.tasks.size();
+  release(job.mutex);
+  for (unsigned i=0; i<tid.size(); ++i) job.slots.signal();
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  if (fclose(dataout)) errors=1;
+  dataout=FPNULL;
+  printf("%1.0f bytes of %d files written\n", written+0.0,
+      int(outfiles.size()));
+  return errors;
+}
+
 // Copy at most n bytes from in to out (default all). Return how many copied.
 int64_t copy(libzpaq::Reader& in, libzpaq::Writer& out, uint64_t n=~0ull) {
   const unsigned BUFSIZE=4096;
@@ -3094,6 +5971,24 @@ int64_t copy(libzpaq::Reader& in, libzpaq::Writer& out, uint64_t n=~0ull) {
   return result;
 }
 
+// Trim the fragment list of p to those that overlap -range, found by
+// binary search in a SeekTable, and save in rangeskip[] how far the
+// range starts into the first one. Return the total size of the
+// remaining fragments, or -1 if any size is unknown (streaming).
+int64_t Jidac::trimRange(DTMap::iterator p) {
+  vector<unsigned>& ptr=p->second.ptr;
+  if (ptr.size()==0) return 0;
+  SeekTable st(ptr, ht);
+  if (st.off.size()==0) return -1;
+  int64_t end=st.off.back();  // end of range
+  if (rangesize>=0 && rangestart+rangesize<end) end=rangestart+rangesize;
+  const unsigned i0=min(st.find(rangestart), unsigned(ptr.size()-1));
+  const unsigned i1=max(st.find(end-1)+1, i0+1);
+  rangeskip[p->first]=rangestart-st.off[i0];
+  vector<unsigned>(ptr.begin()+i0, ptr.begin()+i1).swap(ptr);
+  return st.off[i1]-st.off[i0];
+}
+
 // Extract files from archive. If force is true then overwrite
 // existing files and set the dates and attributes of exising directories.
 // Otherwise create only new files and directories. Return 1 if error else 0.
@@ -3105,8 +6000,8 @@ int Jidac::extract() {
         || noattributes || version!=DEFAULT_VERSION || method!="")
       error("-repack -all does not allow partial copy");
     InputArchive in(archive.c_str(), password);
-    if (force) delete_file(repack);
-    if (exists(repack)) error("output file exists");
+    if (force) storage->remove(repack);
+    if (storage->size(repack)>=0) error("output file exists");
 
     // Get key and salt
     char salt[32]={0};
@@ -3124,6 +6019,19 @@ int Jidac::extract() {
   }
 
   // Read archive
+  if (rangestart>=0 && (repack || index))
+    error("-range does not allow -repack or -index");
+  if ((dataout!=FPNULL || tar) && (repack || index))
+    error("-stdout and -tar do not allow -repack or -index");
+  if (tar && rangestart>=0) error("-tar does not allow -range");
+  if (tarfile) {
+    if (!force && exists(tarfile)) error("tar output exists");
+    dataout=fopen(tarfile, WB);
+    if (dataout==FPNULL) {
+      printerr(tarfile);
+      error("cannot create tar output");
+    }
+  }
   const int64_t sz=read_archive(archive.c_str());
   if (sz<1) error("archive not found");
 
@@ -3143,17 +6051,16 @@ int Jidac::extract() {
   // Create index instead of extract files
   if (index) {
     if (ver.size()<2) error("no journaling data");
-    if (force) delete_file(index);
-    if (exists(index)) error("index file exists");
+    if (force) storage->remove(index);
+    if (storage->size(index)>=0) error("index file exists");
 
     // Get salt
     char salt[32];
     if (ver[1].offset==32) {  // encrypted?
-      FP fp=fopen(subpart(archive, 1).c_str(), RB);
-      if (fp==FPNULL) error("cannot read part 1");
-      if (fread(salt, 1, 32, fp)!=32) error("cannot read salt");
+      const int r=storage->read(subpart(archive, 1), 0, salt, 32);
+      if (r<0) error("cannot read part 1");
+      if (r!=32) error("cannot read salt");
       salt[0]^='7'^'z';  // for index
-      fclose(fp);
     }
     InputArchive in(archive.c_str(), password);
     OutputArchive out(index, password, salt, 0);
@@ -3203,7 +6110,11 @@ int Jidac::extract() {
     if (p->second.date && p->first!="") {
       const string fn=rename(p->first);
       const bool isdir=p->first[p->first.size()-1]=='/';
-      if (!repack && !dotest && force && !isdir && equal(p, fn.c_str())) {
+      const bool tofile=!repack && !dotest && dataout==FPNULL;
+      if (dataout!=FPNULL && isdir && !tar)  // no directories in stdout
+        continue;
+      else if (tofile && force && !isdir && rangestart<0
+          && equal(p, fn.c_str())) {
         if (summary<=0) {  // identical
           printf("= ");
           printUTF8(fn.c_str());
@@ -3212,7 +6123,7 @@ int Jidac::extract() {
         close(fn.c_str(), p->second.date, p->second.attr);
         ++skipped;
       }
-      else if (!repack && !dotest && !force && exists(fn)) {  // exists, skip
+      else if (tofile && !force && exists(fn)) {  // exists, skip
         if (summary<=0) {
           printf("? ");
           printUTF8(fn.c_str());
@@ -3224,6 +6135,14 @@ int Jidac::extract() {
         p->second.data=0;
       else if (block.size()>0) {  // files to decompress
         p->second.data=0;
+        int64_t usize=p->second.size;
+        if (rangestart>=0 && (usize=trimRange(p))<0) {
+          fflush(stdout);
+          printUTF8(p->first.c_str(), stderr);
+          fprintf(stderr, ": -range of streaming file, skipping...\n");
+          p->second.data=-1;  // skip
+          continue;
+        }
         unsigned lo=0, hi=block.size()-1;  // block indexes for binary search
         for (unsigned i=0; p->second.data>=0 && i<p->second.ptr.size(); ++i) {
           unsigned j=p->second.ptr[i];  // fragment index
@@ -3257,7 +6176,7 @@ int Jidac::extract() {
             block[lo].files.push_back(p);
         }
         ++total_files;
-        job.total_size+=p->second.size;
+        job.total_size+=usize;
       }
     }  // end if selected
   }  // end for
@@ -3281,8 +6200,8 @@ int Jidac::extract() {
     InputArchive in(archive.c_str(), password);
 
     // Open output
-    if (!force && exists(repack)) error("repack output exists");
-    delete_file(repack);
+    if (!force && storage->size(repack)>=0) error("repack output exists");
+    storage->remove(repack);
     char salt[32]={0};
     if (new_password) libzpaq::random(salt, 32);
     OutputArchive out(repack, new_password, salt, 0);
@@ -3330,15 +6249,7 @@ int Jidac::extract() {
         puti(is, p->second.date, 8);
         is.write(filename.c_str(), strlen(filename.c_str()));
         is.put(0);
-        if ((p->second.attr&255)=='u') {  // unix attributes
-          puti(is, 3, 4);
-          puti(is, p->second.attr, 3);
-        }
-        else if ((p->second.attr&255)=='w') {  // windows attributes
-          puti(is, 5, 4);
-          puti(is, p->second.attr, 5);
-        }
-        else puti(is, 0, 4);  // no attributes
+        putAttr(is, p->second.attr, p->second.hash);
         puti(is, p->second.ptr.size(), 4);  // list of frag pointers
         for (unsigned i=0; i<p->second.ptr.size(); ++i)
           puti(is, p->second.ptr[i], 4);
@@ -3365,97 +6276,84 @@ int Jidac::extract() {
     return 0;
   }
 
+  // Write to stdout in order
+  if (dataout!=FPNULL) return extractStdout();
+
   // Decompress archive in parallel
   printf("Extracting %1.6f MB in %d files -threads %d\n",
       job.total_size/1000000.0, total_files, threads);
   vector<ThreadID> tid(threads);
   for (unsigned i=0; i<tid.size(); ++i) run(tid[i], decompressThread, &job);
 
-  // Extract streaming files
+  // Extract streaming files. Blocks are decompressed by streamThreads
+  // and written here in order.
   unsigned segments=0;  // count
-  InputArchive in(archive.c_str(), password);
-  if (in.isopen()) {
-    FP outf=FPNULL;
-    DTMap::iterator dtptr=dt.end();
-    for (unsigned i=0; i<block.size(); ++i) {
-      if (block[i].usize<0 && block[i].size>0) {
-        Block& b=block[i];
-        try {
-          in.seek(b.offset, SEEK_SET);
-          libzpaq::Decompresser d;
-          d.setInput(&in);
-          if (!d.findBlock()) error("block not found");
-          StringWriter filename;
-          for (unsigned j=0; j<b.size; ++j) {
-            if (!d.findFilename(&filename)) error("segment not found");
-            d.readComment();
-
-            // Start of new output file
-            if (filename.s!="" || segments==0) {
-              unsigned k;
-              for (k=0; k<b.files.size(); ++k) {  // find in dt
-                if (b.files[k]->second.ptr.size()>0
-                    && b.files[k]->second.ptr[0]==b.start+j
-                    && b.files[k]->second.date>0
-                    && b.files[k]->second.data==0)
-                  break;
-              }
-              if (k<b.files.size()) {  // found new file
-                if (outf!=FPNULL) fclose(outf);
-                outf=FPNULL;
-                string outname=rename(b.files[k]->first);
-                dtptr=b.files[k];
-                lock(job.mutex);
-                if (summary<=0) {
-                  printf("> ");
-                  printUTF8(outname.c_str());
-                  printf("\n");
-                }
-                if (!dotest) {
-                  makepath(outname);
-                  outf=fopen(outname.c_str(), WB);
-                  if (outf==FPNULL) printerr(outname.c_str());
-                }
-                release(job.mutex);
-              }
-              else {  // end of file
-                if (outf!=FPNULL) fclose(outf);
-                outf=FPNULL;
-                dtptr=dt.end();
-              }
-            }
-
-            // Decompress segment
-            libzpaq::SHA1 sha1;
-            d.setSHA1(&sha1);
-            OutputFile o(outf);
-            d.setOutput(&o);
-            d.decompress();
-
-            // Verify checksum
-            char sha1result[21];
-            d.readSegmentEnd(sha1result);
-            if (sha1result[0]==1) {
-              if (memcmp(sha1result+1, sha1.result(), 20)!=0)
-                error("checksum failed");
-            }
-            else if (sha1result[0]!=0)
-              error("unknown checksum type");
-            ++b.extracted;
-            if (dtptr!=dt.end()) ++dtptr->second.data;
-            filename.s="";
-            ++segments;
-          }
+  StreamJob sjob(*this, threads*2);
+  for (unsigned i=0; i<block.size(); ++i)
+    if (block[i].usize<0 && block[i].size>0) sjob.blocks.push_back(i);
+  vector<ThreadID> sid(sjob.blocks.size() ? threads : 0);
+  for (unsigned i=0; i<sid.size(); ++i) run(sid[i], streamThread, &sjob);
+  FP outf=FPNULL;
+  DTMap::iterator dtptr=dt.end();
+  for (unsigned n=0; n<sjob.blocks.size(); ++n) {
+    SJ& sj=sjob.q[n%sjob.qsize];
+    sj.done.wait();
+    Block& b=block[sjob.blocks[n]];
+    const char* p=sj.out.c_str();
+    for (unsigned j=0; j<sj.sizes.size(); ++j) {
+
+      // Start of new output file
+      if (sj.named[j] || segments==0) {
+        unsigned k;
+        for (k=0; k<b.files.size(); ++k) {  // find in dt
+          if (b.files[k]->second.ptr.size()>0
+              && b.files[k]->second.ptr[0]==b.start+j
+              && b.files[k]->second.date>0
+              && b.files[k]->second.data==0)
+            break;
         }
-        catch(std::exception& e) {
+        if (k<b.files.size()) {  // found new file
+          if (outf!=FPNULL) fclose(outf);
+          outf=FPNULL;
+          string outname=rename(b.files[k]->first);
+          dtptr=b.files[k];
           lock(job.mutex);
-          printf("Skipping block: %s\n", e.what());
+          if (summary<=0) {
+            printf("> ");
+            printUTF8(outname.c_str());
+            printf("\n");
+          }
+          if (!dotest) {
+            makepath(outname);
+            outf=fopen(outname.c_str(), WB);
+            if (outf==FPNULL) printerr(outname.c_str());
+          }
           release(job.mutex);
         }
+        else {  // end of file
+          if (outf!=FPNULL) fclose(outf);
+          outf=FPNULL;
+          dtptr=dt.end();
+        }
       }
+
+      // Write segment
+      if (outf!=FPNULL && sj.sizes[j]>0) fwrite(p, 1, sj.sizes[j], outf);
+      p+=sj.sizes[j];
+      ++b.extracted;
+      if (dtptr!=dt.end()) ++dtptr->second.data;
+      ++segments;
+    }
+    if (sj.err!="") {
+      lock(job.mutex);
+      printf("Skipping block: %s\n", sj.err.c_str());
+      release(job.mutex);
     }
-    if (outf!=FPNULL) fclose(outf);
+    sj.out.resize(0);
+    sjob.slots.signal();
   }
+  if (outf!=FPNULL) fclose(outf);
+  for (unsigned i=0; i<sid.size(); ++i) join(sid[i]);
   if (segments>0) printf("%u streaming segments extracted\n", segments);
 
   // Wait for threads to finish
@@ -3504,6 +6402,642 @@ int Jidac::extract() {
   return errors>0;
 }
 
+/////////////////////////////// grep //////////////////////////////////
+
+// Search the contents of selected files in the archive for a string
+// without extracting them. Each block containing fragments of a selected
+// file is decompressed once by one of the grepThreads, and each fragment
+// is searched once no matter how many files or versions point to it.
+// Matches that cross fragment boundaries are found afterwards from the
+// first and last m-1 bytes of each fragment (m = pattern length), saved
+// while the block was in memory. Matches are then mapped to file offsets
+// through the fragment lists in dt.
+
+// A match inside a fragment
+struct Hit {
+  unsigned frag;         // fragment ID
+  unsigned pos;          // offset of match in fragment
+  string line;           // text around match
+  Hit(unsigned f=0, unsigned p=0, const string& s=""):
+      frag(f), pos(p), line(s) {}
+  bool operator<(const Hit& h) const {
+    return frag<h.frag || (frag==h.frag && pos<h.pos);
+  }
+};
+
+struct GrepJob {
+  Mutex mutex;              // protects state
+  Jidac& jd;                // what to search
+  vector<bool> need;        // need[i]: fragment i is in a selected file
+  unsigned next;            // next block to search
+  vector<Hit> hits;         // matches inside fragments
+  map<unsigned, string> edges;  // first and last m-1 bytes of fragments
+  int errors;               // blocks not searched
+  GrepJob(Jidac& j): jd(j), next(0), errors(0) {init_mutex(mutex);}
+  ~GrepJob() {destroy_mutex(mutex);}
+};
+
+// Return the line of p[0..n-1] containing the match of length m at pos,
+// clipped to 40 bytes on either side, with control characters as '.'
+static string grepLine(const char* p, unsigned n, unsigned pos, unsigned m) {
+  unsigned lo=pos, hi=pos+m;
+  while (lo>0 && pos-lo<40 && p[lo-1]!='\n' && p[lo-1]!='\r') --lo;
+  while (hi<n && hi-pos-m<40 && p[hi]!='\n' && p[hi]!='\r') ++hi;
+  string s(p+lo, hi-lo);
+  for (unsigned i=0; i<s.size(); ++i)
+    if ((s[i]&255)<32 || s[i]==127) s[i]='.';
+  return s;
+}
+
+// Decompress and search blocks until none are left
+ThreadReturn grepThread(void* arg) {
+  GrepJob& job=*(GrepJob*)arg;
+  Jidac& jd=job.jd;
+  const string& pat=jd.pattern;
+  const unsigned m=pat.size();
+  InputArchive in(jd.archive.c_str(), jd.password);
+  if (!in.isopen()) return 0;
+  StringBuffer out;
+  while (true) {
+
+    // Get next block with selected fragments
+    lock(job.mutex);
+    unsigned k=job.next;
+    while (k<jd.block.size()
+           && (jd.block[k].size==0 || jd.block[k].usize<0)) ++k;
+    job.next=k+1;
+    release(job.mutex);
+    if (k>=jd.block.size()) return 0;
+    Block& b=jd.block[k];
+
+    // Decompress as much of the block as needed
+    vector<Hit> hits;
+    vector<std::pair<unsigned, string> > edges;
+    try {
+      unsigned output_size=0;
+      for (unsigned j=0; j<b.size; ++j)
+        output_size+=jd.ht[b.start+j].usize;
+      in.seek(b.offset, SEEK_SET);
+      libzpaq::Decompresser d;
+      d.setInput(&in);
+      out.resize(0);
+      out.setLimit(b.usize);
+      d.setOutput(&out);
+      if (!d.findBlock()) error("archive block not found");
+      while (d.findFilename()) {
+        d.readComment();
+        while (out.size()<output_size && d.decompress(1<<14));
+        if (out.size()>=output_size) break;
+        d.readSegmentEnd();
+      }
+      if (out.size()<output_size)
+        error("unexpected end of compressed data");
+
+      // Search each needed fragment and save its ends
+      const char* q=out.c_str();
+      for (unsigned j=b.start; j<b.start+b.size; q+=jd.ht[j++].usize) {
+        if (!job.need[j]) continue;
+        const unsigned n=jd.ht[j].usize;
+        for (const char* p=q; m>0 && p+m<=q+n; ++p) {
+          p=(const char*)memchr(p, pat[0], q+n-m+1-p);
+          if (!p) break;
+          if (memcmp(p, pat.c_str(), m)==0)
+            hits.push_back(Hit(j, p-q, grepLine(q, n, p-q, m)));
+        }
+        if (m>1 && n<=2*(m-1))
+          edges.push_back(std::make_pair(j, string(q, n)));
+        else if (m>1)
+          edges.push_back(std::make_pair(j,
+              string(q, m-1)+string(q+n-(m-1), m-1)));
+      }
+    }
+    catch (std::exception& e) {
+      lock(job.mutex);
+      fflush(stdout);
+      fprintf(stderr, "Skipping [%u..%u] at %1.0f: %s\n",
+              b.start, b.start+b.size-1, b.offset+0.0, e.what());
+      ++job.errors;
+      release(job.mutex);
+      continue;
+    }
+
+    // Save results
+    lock(job.mutex);
+    job.hits.insert(job.hits.end(), hits.begin(), hits.end());
+    for (unsigned i=0; i<edges.size(); ++i)
+      job.edges[edges[i].first].swap(edges[i].second);
+    release(job.mutex);
+  }
+  return 0;
+}
+
+// Search selected files for pattern. Print path:offset: line for each
+// match. Return 1 if any blocks could not be searched, else 0.
+int Jidac::grep() {
+  if (pattern=="") error("empty pattern");
+  const unsigned m=pattern.size();
+  read_archive(archive.c_str());
+
+  // Mark fragments of selected files and set the number of fragments
+  // to decompress in each block
+  GrepJob job(*this);
+  job.need.resize(ht.size());
+  int total_files=0, streaming=0;
+  for (DTMap::iterator p=dt.begin(); p!=dt.end(); ++p) {
+    p->second.data=-1;
+    if (p->second.date==0 || p->first=="") continue;
+    bool ok=true;
+    for (unsigned i=0; ok && i<p->second.ptr.size(); ++i) {
+      const unsigned j=p->second.ptr[i];
+      if (j==0 || j>=ht.size() || ht[j].usize<0) ok=false;
+    }
+    if (!ok) {
+      ++streaming;
+      continue;
+    }
+    p->second.data=0;
+    ++total_files;
+    for (unsigned i=0; i<p->second.ptr.size(); ++i)
+      job.need[p->second.ptr[i]]=true;
+  }
+  int64_t total_size=0;
+  int blocks=0;
+  for (unsigned i=0; i<block.size(); ++i) {
+    if (block[i].usize<0) continue;
+    const unsigned end=i+1<block.size() ? block[i+1].start : ht.size();
+    for (unsigned j=block[i].start; j<end && j<ht.size(); ++j)
+      if (job.need[j]) block[i].size=j-block[i].start+1;
+    if (block[i].size>0) {
+      ++blocks;
+      for (unsigned j=0; j<block[i].size; ++j)
+        total_size+=ht[block[i].start+j].usize;
+    }
+  }
+  printf("Searching %1.6f MB in %d blocks of %d files -threads %d\n",
+      total_size/1000000.0, blocks, total_files, threads);
+  if (streaming>0)
+    printf("%d streaming files not searched.\n", streaming);
+
+  // Search blocks in parallel
+  vector<ThreadID> tid(threads);
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], grepThread, &job);
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  std::sort(job.hits.begin(), job.hits.end());
+
+  // Map matches to files
+  int64_t matches=0;
+  int matched_files=0;
+  for (DTMap::iterator p=dt.begin(); p!=dt.end(); ++p) {
+    if (p->second.data<0) continue;
+    const vector<unsigned>& ptr=p->second.ptr;
+    vector<std::pair<int64_t, string> > fh;  // offset, line
+    int64_t offset=0;  // of fragment ptr[i] in file
+    for (unsigned i=0; i<ptr.size(); ++i) {
+      const unsigned j=ptr[i];
+      const unsigned n=ht[j].usize;
+
+      // Matches inside fragment j
+      vector<Hit>::iterator h=std::lower_bound(job.hits.begin(),
+          job.hits.end(), Hit(j, 0));
+      for (; h!=job.hits.end() && h->frag==j; ++h)
+        fh.push_back(std::make_pair(offset+h->pos, h->line));
+
+      // Matches starting in fragment j and ending after it
+      if (m>1 && i+1<ptr.size()) {
+        string back, fwd;  // up to m-1 bytes before and after the boundary
+        for (int a=i; a>=0 && back.size()<m-1; --a) {
+          const string& e=job.edges[ptr[a]];
+          string tail=e;
+          if (unsigned(ht[ptr[a]].usize)>2*(m-1))
+            tail=e.size()>m-1 ? e.substr(m-1) : "";
+          const size_t t=std::min<size_t>(m-1-back.size(), tail.size());
+          back=tail.substr(tail.size()-t)+back;
+        }
+        for (unsigned a=i+1; a<ptr.size() && fwd.size()<m-1; ++a) {
+          const string& e=job.edges[ptr[a]];
+          fwd+=e.substr(0, m-1-fwd.size());
+        }
+        const string w=back+fwd;
+        const unsigned start=back.size()-std::min<size_t>(back.size(), n);
+        for (unsigned pos=start; pos<back.size() && pos+m<=w.size(); ++pos)
+          if (w.compare(pos, m, pattern)==0)
+            fh.push_back(std::make_pair(offset+n-back.size()+pos,
+                grepLine(w.c_str(), w.size(), pos, m)));
+      }
+      offset+=n;
+    }
+
+    // Print in file order
+    if (fh.size()==0) continue;
+    ++matched_files;
+    matches+=fh.size();
+    std::sort(fh.begin(), fh.end());
+    for (unsigned i=0; i<fh.size(); ++i) {
+      printUTF8(rename(p->first).c_str());
+      printf(":%1.0f: ", fh[i].first+0.0);
+      printUTF8(fh[i].second.c_str());
+      printf("\n");
+    }
+  }
+  printf("%1.0f matches in %d of %d files.\n",
+      matches+0.0, matched_files, total_files);
+  return job.errors>0;
+}
+
+/////////////////////////////// salvage ///////////////////////////////
+
+// Recover a damaged archive by searching it for blocks, ignoring the
+// transaction headers (C) and fragment tables (H) that normally locate
+// them. The archive is split into chunks which are searched for the
+// block locator tag in parallel. Each block found is decompressed and
+// checked by one of a set of salvageThreads. Data blocks (D) are copied
+// unchanged to the output with new fragment tables computed from their
+// contents, followed by the recovered indexes (I) of their transaction.
+// Fragments keep their original numbers, so the index still points
+// to them. Streaming blocks whose segments all pass their checksums are
+// copied unchanged.
+
+// Block locator tag followed by "zPQ"
+static const char zpaqtag[16]={
+  0x37, 0x6b, 0x53, 0x74, char(0xa0), 0x31, char(0x83), char(0xd3),
+  char(0x8c), char(0xb2), 0x28, char(0xb0), char(0xd3), 'z', 'P', 'Q'};
+
+// A block found by salvage
+struct SB {
+  int64_t offset;       // location of tag in archive
+  int64_t csize;        // compressed size or 0 if damaged
+  int64_t date;         // of journaling block or 0 if streaming
+  unsigned num;         // number in journaling block name
+  char type;            // c, d, h, i, or 0 if streaming
+  string sha1s;         // d: fragment hashes, i: contents
+  vector<unsigned> sizes;  // d: fragment sizes
+  SB(int64_t o=0): offset(o), csize(0), date(0), num(0), type(0) {}
+  bool operator<(const SB& b) const {
+    return date<b.date || (date==b.date && (type<b.type
+        || (type==b.type && (num<b.num || (num==b.num && offset<b.offset)))));
+  }
+};
+
+struct SalvageJob {
+  Mutex mutex;          // protects state
+  Jidac& jd;            // archive to search
+  int64_t size;         // archive size
+  int64_t next;         // next chunk to search or block to check
+  vector<int64_t> tags; // offsets of locator tags found
+  vector<SB> blocks;    // blocks found at tags
+  SalvageJob(Jidac& j, int64_t sz): jd(j), size(sz), next(0) {
+    init_mutex(mutex);
+  }
+  ~SalvageJob() {destroy_mutex(mutex);}
+};
+
+// Search 1 MiB chunks for locator tags until none are left
+ThreadReturn locateThread(void* arg) {
+  SalvageJob& job=*(SalvageJob*)arg;
+  const int CHUNK=1<<20;
+  InputArchive in(job.jd.archive.c_str(), job.jd.password);
+  if (!in.isopen()) return 0;
+  vector<char> buf(CHUNK+15);
+  while (true) {
+    lock(job.mutex);
+    const int64_t p=job.next;
+    job.next+=CHUNK;
+    release(job.mutex);
+    if (p>=job.size) return 0;
+
+    // Read chunk and the first 15 bytes of the next
+    int n=0, r;
+    in.seek(p, SEEK_SET);
+    while (n<int(buf.size()) && (r=in.read(&buf[n], buf.size()-n))>0) n+=r;
+
+    // Find tags starting in the chunk
+    vector<int64_t> found;
+    const char* const end=&buf[0]+n;
+    const char* const last=&buf[0]+std::min(n, CHUNK);
+    for (const char* s=&buf[0]; s<last; ++s) {
+      s=(const char*)memchr(s, zpaqtag[0], last-s);
+      if (!s) break;
+      if (end-s>=16 && memcmp(s, zpaqtag, 16)==0)
+        found.push_back(p+(s-&buf[0]));
+    }
+    lock(job.mutex);
+    job.tags.insert(job.tags.end(), found.begin(), found.end());
+    release(job.mutex);
+  }
+  return 0;
+}
+
+// Decompress and test blocks at tags until none are left
+ThreadReturn salvageThread(void* arg) {
+  SalvageJob& job=*(SalvageJob*)arg;
+  InputArchive in(job.jd.archive.c_str(), job.jd.password);
+  if (!in.isopen()) return 0;
+  StringBuffer out;
+  while (true) {
+    lock(job.mutex);
+    const int64_t k=job.next++;
+    release(job.mutex);
+    if (k>=int64_t(job.tags.size())) return 0;
+    SB sb(job.tags[k]);
+    try {
+      in.seek(sb.offset, SEEK_SET);
+      libzpaq::Decompresser d;
+      d.setInput(&in);
+      if (!d.findBlock()) error("no block");
+      StringWriter filename, comment;
+      int segs=0;
+      while (d.findFilename(&filename)) {
+        comment.s="";
+        d.readComment(&comment);
+        const bool jdc=comment.s.size()>=4
+            && comment.s.substr(comment.s.size()-4)=="jDC\x01";
+        if (segs>0 && (jdc || sb.type)) error("mixed block");
+
+        // Parse jDC<date>[cdhi]<num> and size from comment
+        int64_t usize=-1;
+        if (jdc) {
+          if (filename.s.size()!=28 || filename.s.substr(0, 3)!="jDC")
+            error("bad journaling block name");
+          unsigned i;
+          for (i=0; i<comment.s.size() && isdigit(comment.s[i]); ++i) {
+            usize=(usize<0 ? 0 : usize*10)+comment.s[i]-'0';
+            if (usize>0xffffffff) error("journaling block too big");
+          }
+          for (i=3; i<17 && isdigit(filename.s[i]); ++i)
+            sb.date=sb.date*10+filename.s[i]-'0';
+          if (i!=17 || sb.date<19000000000000LL
+              || sb.date>=30000000000000LL) error("bad date");
+          int64_t num=0;
+          for (i=18; i<28 && isdigit(filename.s[i]); ++i)
+            num=num*10+filename.s[i]-'0';
+          if (i!=28 || num>0xffffffff) error("bad number");
+          sb.num=num;
+          sb.type=filename.s[17];
+          if (!strchr("cdhi", sb.type)) error("bad block type");
+        }
+        filename.s="";
+
+        // Decompress, keeping the contents of D and I blocks
+        out.resize(0);
+        if (usize>=0) out.setLimit(usize);
+        d.setOutput(sb.type=='d' || sb.type=='i' ? &out : 0);
+        libzpaq::SHA1 sha1;
+        d.setSHA1(&sha1);
+        d.decompress();
+        char sha1result[21]={0};
+        d.readSegmentEnd(sha1result);
+        if (usize>=0 && int64_t(sha1.usize())!=usize) error("bad size");
+        if (sha1result[0] && memcmp(sha1result+1, sha1.result(), 20))
+          error("bad checksum");
+        ++segs;
+      }
+      sb.csize=in.tell()-d.buffered()-sb.offset;
+
+      // Hash fragments of D block: data[] sizes[4*n] 0[4] n[4]
+      if (sb.type=='d') {
+        const char* s=out.c_str()+out.size()-4;
+        if (out.size()<8) error("d block too small");
+        const unsigned n=btoi(s);
+        if (n>(out.size()-8)/4) error("bad fragment count");
+        s=out.c_str()+out.size()-8-4*n;
+        const char* p=out.c_str();
+        libzpaq::SHA1 sha1;
+        for (unsigned i=0; i<n; ++i) {
+          const unsigned f=btoi(s);
+          if (f>size_t(out.c_str()+out.size()-8-4*n-p))
+            error("bad fragment size");
+          sha1.write(p, f);
+          p+=f;
+          sb.sha1s.append(sha1.result(), 20);
+          sb.sizes.push_back(f);
+        }
+        if (p!=out.c_str()+out.size()-8-4*n) error("bad fragment sizes");
+      }
+      else if (sb.type=='i')
+        sb.sha1s.assign(out.c_str(), out.size());
+    }
+    catch (std::exception& e) {
+      sb=SB(sb.offset);
+    }
+    lock(job.mutex);
+    job.blocks[k]=sb;
+    release(job.mutex);
+  }
+  return 0;
+}
+
+// Recover blocks of a damaged archive into the new archive files[0].
+// Return 1 if any blocks are damaged or missing, else 0.
+int Jidac::salvage() {
+  const string& output=files[0];
+  InputArchive in(archive.c_str(), password);
+  if (!in.isopen()) error("archive not found");
+  in.seek(0, SEEK_END);
+  SalvageJob job(*this, in.tell());
+  if (force) storage->remove(output);
+  if (storage->size(output)>=0) error("output file exists");
+  printf("Searching %1.0f bytes -threads %d\n", job.size+0.0, threads);
+
+  // Find and test blocks in parallel
+  vector<ThreadID> tid(threads);
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], locateThread, &job);
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  std::sort(job.tags.begin(), job.tags.end());
+  job.blocks.resize(job.tags.size());
+  job.next=0;
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], salvageThread, &job);
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+
+  // Discard damaged blocks, blocks inside other blocks (such as stored
+  // archives), and later copies of journaling blocks
+  vector<SB> sb;  // streaming blocks in archive order
+  vector<SB> jb;  // journaling blocks by date, type, number
+  int damaged=0;
+  int64_t last=0;  // end of last good block
+  for (unsigned i=0; i<job.blocks.size(); ++i) {
+    SB& b=job.blocks[i];
+    if (b.offset<last) continue;
+    if (b.csize<=0) {
+      ++damaged;
+      continue;
+    }
+    last=b.offset+b.csize;
+    if (b.type) jb.push_back(b);
+    else sb.push_back(b);
+  }
+  std::stable_sort(jb.begin(), jb.end());
+  unsigned n=0;
+  for (unsigned i=0; i<jb.size(); ++i)
+    if (n==0 || jb[i].date!=jb[n-1].date || jb[i].type!=jb[n-1].type
+        || jb[i].num!=jb[n-1].num)
+      jb[n++]=jb[i];
+  jb.resize(n);
+  int count[128]={0};
+  for (unsigned i=0; i<jb.size(); ++i) ++count[jb[i].type&127];
+  printf("Found %d blocks: %d data, %d index, %d header, %d table, "
+         "%d streaming, %d damaged\n",
+         int(job.tags.size()), count['d'], count['i'], count['c'],
+         count['h'], int(sb.size()), damaged);
+
+  // Map fragment IDs to D blocks
+  vector<std::pair<unsigned, unsigned> > frags;  // first ID, index in jb
+  for (unsigned i=0; i<jb.size(); ++i)
+    if (jb[i].type=='d') frags.push_back(std::make_pair(jb[i].num, i));
+  std::sort(frags.begin(), frags.end());
+  vector<bool> used(jb.size());
+
+  // Mark D blocks referenced by recovered files. Count files pointing
+  // to missing fragments.
+  int nfiles=0, incomplete=0;
+  for (unsigned i=0; i<jb.size(); ++i) {
+    if (jb[i].type!='i') continue;
+    const char* s=jb[i].sha1s.c_str();
+    const char* const end=s+jb[i].sha1s.size();
+    while (s+9<=end) {
+      const int64_t fdate=btol(s);
+      s+=strlen(s)+1;
+      if (!fdate || s+4>end) continue;
+      const unsigned na=btoi(s);
+      if (na>unsigned(end-s)) break;
+      s+=na;
+      if (s+4>end) break;
+      const unsigned ni=btoi(s);
+      if (ni>unsigned(end-s)/4) break;
+      bool ok=true;
+      for (unsigned j=0; j<ni; ++j) {
+        const unsigned id=btoi(s);
+        vector<std::pair<unsigned, unsigned> >::iterator p=std::upper_bound(
+            frags.begin(), frags.end(), std::make_pair(id, ~0u));
+        if (p==frags.begin()) ok=false;
+        else {
+          --p;
+          if (id-p->first>=jb[p->second].sizes.size()) ok=false;
+          else used[p->second]=true;
+        }
+      }
+      ++nfiles;
+      if (!ok) ++incomplete;
+    }
+  }
+
+  // Copy streaming blocks
+  char salt[32]={0};
+  if (password) libzpaq::random(salt, 32);
+  OutputArchive out(output.c_str(), password, salt, 0);
+  for (unsigned i=0; i<sb.size(); ++i) {
+    in.seek(sb[i].offset, SEEK_SET);
+    copy(in, out, sb[i].csize);
+  }
+
+  // Write one transaction for each date with D or I blocks
+  int orphans=0;
+  unsigned nextid=1;
+  for (unsigned i=0; i<jb.size();) {
+    const int64_t fdate=jb[i].date;
+    unsigned j=i;
+    while (j<jb.size() && jb[j].date==fdate) ++j;
+    vector<unsigned> dblocks, iblocks;
+    for (; i<j; ++i) {
+      if (jb[i].type=='d') dblocks.push_back(i);
+      if (jb[i].type=='i') iblocks.push_back(i);
+    }
+    if (dblocks.size()==0 && iblocks.size()==0) continue;
+
+    // Copy D blocks after a C block
+    const int64_t cstart=out.tell();
+    const unsigned firstid=dblocks.size() ? jb[dblocks[0]].num : nextid;
+    writeJidacHeader(&out, fdate, -1, firstid);
+    const int64_t dstart=out.tell();
+    for (unsigned k=0; k<dblocks.size(); ++k) {
+      SB& b=jb[dblocks[k]];
+      in.seek(b.offset, SEEK_SET);
+      copy(in, out, b.csize);
+      nextid=std::max(nextid, unsigned(b.num+b.sizes.size()));
+    }
+    const int64_t csize=out.tell()-dstart;
+
+    // Write H blocks computed from D blocks
+    for (unsigned k=0; k<dblocks.size(); ++k) {
+      SB& b=jb[dblocks[k]];
+      StringBuffer is;
+      puti(is, b.csize, 4);
+      for (unsigned f=0; f<b.sizes.size(); ++f) {
+        is.write(b.sha1s.c_str()+20*f, 20);
+        puti(is, b.sizes[f], 4);
+      }
+      libzpaq::compressBlock(&is, &out, "0",
+          ("jDC"+itos(fdate, 14)+"h"+itos(b.num, 10)).c_str(), "jDC\x01");
+    }
+
+    // Write recovered I blocks, then list unreferenced D blocks
+    // as files named salvage/<block name>
+    unsigned dtcount=0;
+    for (unsigned k=0; k<iblocks.size(); ++k) {
+      StringBuffer is;
+      const string& s=jb[iblocks[k]].sha1s;
+      is.write(s.c_str(), s.size());
+      libzpaq::compressBlock(&is, &out, "1",
+          ("jDC"+itos(fdate, 14)+"i"+itos(jb[iblocks[k]].num, 10)).c_str(),
+          "jDC\x01");
+      dtcount=std::max(dtcount, jb[iblocks[k]].num);
+    }
+    StringBuffer is;
+    for (unsigned k=0; k<dblocks.size(); ++k) {
+      SB& b=jb[dblocks[k]];
+      if (used[dblocks[k]]) continue;
+      ++orphans;
+      const string fn="salvage/jDC"+itos(fdate, 14)+"d"+itos(b.num, 10);
+      puti(is, fdate, 8);
+      is.write(fn.c_str(), fn.size()+1);
+      puti(is, 0, 4);  // no attributes
+      puti(is, b.sizes.size(), 4);
+      for (unsigned f=0; f<b.sizes.size(); ++f)
+        puti(is, b.num+f, 4);
+    }
+    if (is.size()>0)
+      libzpaq::compressBlock(&is, &out, "1",
+          ("jDC"+itos(fdate, 14)+"i"+itos(dtcount+1, 10)).c_str(),
+          "jDC\x01");
+
+    // Rewrite C block
+    const int64_t cend=out.tell();
+    out.seek(cstart, SEEK_SET);
+    writeJidacHeader(&out, fdate, csize, firstid);
+    out.seek(cend, SEEK_SET);
+  }
+
+  // Summarize
+  printUTF8(archive.c_str());
+  printf(" %1.0f -> ", job.size+0.0);
+  printUTF8(output.c_str());
+  printf(" %1.0f\n", out.tell()+0.0);
+  out.close();
+  printf("%d files recovered, %d with missing fragments, "
+         "%d unindexed data blocks as salvage/\n",
+         nfiles-incomplete, incomplete, orphans);
+  return damaged>0 || incomplete>0;
+}
+
+////////////////////////////// compile //////////////////////////////
+
+// Write C++ source to archive that implements -method x... or s... for
+// linking into zpaq with make AOT=archive.
+int Jidac::compile() {
+  if (method=="" || (method[0]!='x' && method[0]!='s'))
+    error("compile requires -method x... or s...");
+  if (!force && exists(archive)) error("output file exists");
+  StringBuffer sb;
+  libzpaq::compileAOT(method.c_str(), &sb);
+  FP fp=fopen(archive.c_str(), WB);
+  if (fp==FPNULL) ioerr(archive.c_str());
+  if (fwrite(sb.c_str(), 1, sb.size(), fp)!=sb.size()) ioerr(archive.c_str());
+  fclose(fp);
+  printf("-method %s -> ", method.c_str());
+  printUTF8(archive.c_str());
+  printf(" %1.0f\n", sb.size()+0.0);
+  return 0;
+}
+
 /////////////////////////////// list //////////////////////////////////
 
 // Return p<q for sorting files by decreasing size, then fragment ID list
@@ -3719,6 +7253,7 @@ int main() {
 #endif
 
   global_start=mtime();  // get start time
+  libzpaq::parallelFor=runParallel;
   int errorcode=0;
   try {
     Jidac jidac;